@@ -2,15 +2,53 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <vector>
+#include <cstring>
+#include <climits>
+#include <string_view>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <filesystem>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_COUNTER 1
+#else
+#define CYCLE_COUNTER 0
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
 
 using namespace std;
 
 typedef int8_t i8;
 typedef int16_t i16;
 typedef int32_t i32;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
 
 // enums
-enum Operation {
+enum Operation : u8 {
     conditional_jump,
     immediate_to_register,
     immediate_to_register_mem,
@@ -20,7 +58,7 @@ enum Operation {
     unknown
 };
 
-enum Mnemonic
+enum Mnemonic : u8
 {
     add,
     cmp,
@@ -48,20 +86,14 @@ enum Mnemonic
     sub
 };
 
-enum WFlag
+enum WFlag : u8
 {
     Byte,
     Not_specified,
     Word
 };
 
-enum Lo_Hi_Byte {
-    low_byte,
-    high_byte,
-    neither
-};
-
-enum MOD
+enum MOD : u8
 {
     memory_mode,
     memory_mode_8_bit,
@@ -69,13 +101,7 @@ enum MOD
     register_mode
 };
 
-enum class DispFlag
-{
-    Has_Displacement,
-    No_Displacement
-};
-
-enum class RM
+enum class RM : u8
 {
     al,
     cl,
@@ -117,7 +143,7 @@ enum class RM
     not_set
 };
 
-enum class SR
+enum class SR : u8
 {
     cs,
     ds,
@@ -125,7 +151,7 @@ enum class SR
     ss
 };
 
-enum Direction {
+enum Direction : u8 {
     accumulator_is_source,
     accumulator_is_destination,
     register_is_source,
@@ -134,71 +160,82 @@ enum Direction {
     segment_register_is_destination
 };
 
-// Struct definitions
+// Struct definitions, operand forms are 8 bytes at most so an instruction packs into 16
+// source/dest/operandOne are register file byte offsets (see CPU), noRegister for a memory operand
 struct Immediate_to_register
 {
     RM reg;
-    int data;
-    RM dest;
-    int source;
+    i16 data;
+    u8 dest;
+    i16 source;
+};
+
+// Forms with a memory operand start with its displacement, so getCPUMem reads it through
+// Memory_operand whichever form was decoded
+struct Memory_operand
+{
+    i16 disp;
 };
 
 struct Immediate_to_register_mem
 {
+    i16 disp;
     RM rm;
     MOD mod;
-    int data;
-    int disp;
-    int s;
-    int source;
-    RM dest;
+    i16 data;
+    u8 s;
+    u8 dest;
 };
 
 struct Memory_to_acc_or_vv
 {
-    int address;
+    i16 disp; // the direct address, listed unsigned
     Direction d;
     RM operandOne;
-    int operandTwo;
 };
 
 struct Register_mem_to_from_register
 {
+    i16 disp;
     RM rm;
     RM reg;
     MOD mod;
     Direction d;
-    int disp;
-    RM source;
-    RM dest;
+    u8 source;
+    u8 dest;
 };
 
 struct Register_mem_to_from_seg_register
 {
+    i16 disp;
     RM rm;
     MOD mod;
     Direction d;
-    int disp;
     SR sr;
-    RM operandOne;
+    u8 operandOne;
     SR operandTwo;
 };
 
 struct Conditional_jump
 {
-    int data;
+    i16 data;
+    u8 condition; // conditionTable entry, low nibble of a 0x70-0x7F opcode
 };
 
 struct instruction
 {
-    Operation op_tag;
-    WFlag w;
-    int op_code;
-    int byteTwo;
-    Mnemonic mnemonic;
+    Operation op_tag = unknown;
+    WFlag w = Word;
+    Mnemonic mnemonic = mov;
+    u8 size = 0;                // bytes, 0 while not yet decoded
+    u8 modRM = 0b00000110;      // ModRM byte, direct address for encodings without one
+    i8 segment = 11;            // segment register slot memory operands go through
+    i8 segmentPrefix = -1;      // slot named by a segment override prefix, -1 if none
+    u8 handler = 0;             // emulateTable entry picked by the decoder, 0 for emulateCommand
 
     union
     {
+        Memory_operand memory;
         Conditional_jump cond_jmp;
         Immediate_to_register imm_to_reg;
         Immediate_to_register_mem imm_to_reg_mem;
@@ -207,11 +244,8 @@ struct instruction
         Register_mem_to_from_seg_register reg_mem_to_from_seg_reg;
     };
 
-    instruction(int op_code, Operation op_tag, Mnemonic mnemonic)
+    instruction()
     {
-        this->op_code = op_code;
-        this->op_tag = op_tag;
-        this->mnemonic = mnemonic;
     }
 
     instruction(Operation op_tag)
@@ -220,25 +254,438 @@ struct instruction
     }
 };
 
-struct CPU
+static_assert(sizeof(instruction) == 16, "decoded instructions are packed 4 to a cache line");
+
+struct Flags
+{
+    u16 value = 0; // FLAGS register, 8086 bit layout
+
+    // Last add/sub/cmp, value is only brought up to date from it when read
+    bool pending = false;
+    Mnemonic lastMnemonic = add;
+    WFlag lastW = Word;
+    i32 lastResult = 0;
+    i32 lastSource = 0;
+};
+
+// Registers, segment bases, ip and FLAGS share one cache line
+struct alignas(64) CPU
+{
+    i16 regSlots[14] = {};   // ax, bx, cx, dx, sp, bp, si, di, es, cs, ss, ds, ip, zeroSlot
+    u32 segmentBase[4] = {}; // es, cs, ss, ds times 16, kept in step by setSegment
+    Flags flag;
+};
+
+static_assert(sizeof(CPU) == 64, "the register file fits one cache line");
+
+// Never written, effective addresses without a base or index register add this slot instead
+const int zeroSlot = 13;
+
+// Byte registers are the halves of ax..dx in place: the register file is addressed by byte offset,
+// al at 0, ah at 1, bl at 2..., and a word register at twice its slot
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "byte registers alias the host's little-endian words");
+const u8 noRegister = 0xFF;
+
+inline u8 *regBytes(CPU &cpu)
+{
+    return reinterpret_cast<u8 *>(cpu.regSlots);
+}
+
+// Longest encoding the decoder reads: segment prefix, opcode, ModRM, 16-bit disp, 16-bit data
+const int maxInstructionSize = 7;
+
+// Estimated 8086 clocks for one executed instruction
+struct ClockEstimate
+{
+    int base = 0;    // instruction clocks, including the extra for a taken jump
+    int ea = 0;      // effective address calculation
+    int penalty = 0; // word transfers to or from an odd address
+};
+
+const size_t maxClocksLength = 64; // longest clock column appended to a trace line
+
+// Hot-spot profile, every counter is indexed by instruction address
+const size_t profileReportSize = 20; // rows in each table of the report
+
+struct LoopCounter
+{
+    long long iterations = 0; // times the loop's branch ran
+    long long exits = 0;      // times it fell through, ending one run of the loop
+    long long current = 0;    // iterations of the run in progress
+    long long longest = 0;
+};
+
+// Counters for one address, kept together so each instruction touches one cache line
+struct alignas(64) AddressCounter
+{
+    long long hits = 0;
+    long long clocks = 0;
+    long long blockEntries = 0;      // when a block starts here
+    long long blockClocks = 0;
+    ClockEstimate estimate;          // encodingClocks of the instruction, filled on its first run
+    RM memoryOperand = RM::not_set;
+    int transfers = 0;
+    bool estimated = false;
+};
+
+struct Profile
+{
+    vector<AddressCounter> counters;
+    vector<LoopCounter> loops;      // by the address of the loop's branch
+    long long totalClocks = 0;
+};
+
+// Binary execution trace. After the magic, one record per executed instruction:
+//   tag byte: bits 0-2 count of raw instruction bytes that follow (0 when this address was recorded before),
+//             then optional fields in this order, each present when its bit is set:
+//   traceHasIp         varint, ip minus the address after the previous instruction
+//   (raw bytes)
+//   traceHasFlags      varint, FLAGS xor its previous value, packed by packTraceFlags
+//   traceHasRegisters  byte, mask of changed ax..di
+//   traceHasSegments   byte, mask of changed es..ds
+//   then a varint per changed register, the 16-bit change since the previous record
+// Varints are 7 bits per byte, low first, and signed values are zigzag encoded
+const char traceMagic[8] = {'8', '0', '8', '6', 'T', 'R', 'C', '1'};
+const u8 traceSizeMask = 0b111;
+const u8 traceHasIp = 1 << 3;
+const u8 traceHasFlags = 1 << 4;
+const u8 traceHasRegisters = 1 << 5;
+const u8 traceHasSegments = 1 << 6;
+const int traceRegisters = 12;     // every register but ip, which follows from the record order
+const size_t traceRecordMax = 64;
+const size_t traceBufferSize = 1 << 20;
+
+struct TraceWriter
+{
+    ostream *out = nullptr;
+    vector<u8> buffer = vector<u8>(traceBufferSize);
+    size_t used = 0;
+    vector<u8> seen;               // addresses whose bytes are already in the trace
+    int expectedIp = 0;
+    u16 flags = 0;
+    i16 registers[traceRegisters] = {}; // as of the previous record, the viewer starts from zero too
+};
+
+// Records shown by the trace viewer
+struct TraceFilter
+{
+    int first = 0;                 // address range, inclusive
+    int last = 0xFFFF;
+    string match;                  // text the disassembly must contain
+};
+
+// Quiet runs: no per-instruction output, stopped after a budget of instructions or seconds (0 = unlimited)
+const long long limitCheckInterval = 1 << 16; // instructions between clock reads
+
+struct RunLimits
 {
-    i16 regSlots[13] = {};
+    long long maxInstructions = 0;
+    double timeoutSeconds = 0;
+    chrono::steady_clock::time_point start;
+    long long nextCheck = limitCheckInterval;
+    string stopped;                // why the run ended early, empty when it reached the end of the code
 };
 
+// 20-bit physical address space, segment * 16 + offset
+const int memorySize = 1 << 20;
+const int memoryMask = memorySize - 1;
+
 struct Memory
 {
-    i8 memSlots[65536] = {};
+    vector<i8> memSlots = vector<i8>(memorySize + maxInstructionSize); // padded so decoding at the top of memory stays in bounds
+    vector<instruction> decodeCache;               // decoded instructions by address, size 0 until decoded
+    bool codeModified = false;                     // set by any store into the program
+    int modifiedFirst = 0;                         // program bytes stored to, kept by the block engines
+    int modifiedLast = -1;
 };
 
-struct Flags
+// Program image, mapped read-only when the input allows it, otherwise read into storage
+struct InputImage
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    void *mapping = nullptr; // mmap'd view of a regular file, nullptr when streamed
+    vector<char> storage;    // bytes read from a pipe, stdin or anything else that can't be mapped
+};
+
+// Text output, collected here and written in large blocks rather than flushed per line
+const size_t outputBufferSize = 1 << 16;
+const size_t maxLineLength = 64; // longest formatted instruction, with room for the newline
+
+struct OutputBuffer
 {
-    bool flags[16] = {};
+    char data[outputBufferSize];
+    size_t used = 0;
+};
+
+// Each thread has its own buffer and destination, so batch workers don't interleave
+thread_local OutputBuffer output;
+thread_local ostream *outputStream = &cout;
+
+// Bounded window over an input stream for disassembly-only mode
+const size_t streamRingSize = 1 << 16; // power of two
+
+struct ByteRing
+{
+    vector<char> bytes = vector<char>(streamRingSize);
+    uint64_t start = 0; // stream offset of the next byte to decode
+    uint64_t end = 0;   // stream offset one past the last byte read
+    bool eof = false;
+};
+
+// Slice of the input decoded by one thread in parallel disassembly
+const size_t disasmChunkSize = 1 << 18;
+
+struct DisasmRun
+{
+    size_t last;  // index one past the run's last instruction in DisasmChunk::starts
+    size_t stop;  // offset after the run's last instruction
+    bool invalid; // the run ended on an unknown opcode at stop
+    bool truncated; // the run ended on an instruction at stop that runs past the end of the input
+};
+
+struct DisasmChunk
+{
+    size_t begin = 0;
+    size_t end = 0;
+    vector<size_t> starts; // offset of each instruction decoded, ascending
+    vector<size_t> text;   // where each instruction's line starts in out
+    vector<char> out;
+    vector<DisasmRun> runs; // a guess restarts one byte on after every unknown opcode
+};
+
+// Batch mode: one input file per job, run on a work-stealing pool
+struct BatchJob
+{
+    string path;
+    string name;            // output path without extension
+    long long executed = 0;
+    string error;           // empty when the run finished
+};
+
+struct WorkQueue
+{
+    mutex lock;
+    deque<size_t> jobs;     // owner pops the back, thieves take the front
+};
+
+// Benchmark suite, one row per listing or synthetic stream
+const double benchMinSeconds = 0.2;          // each measurement repeats until it has run this long
+const int syntheticCodeWindow = 0xE000;      // simulated part of a generated program, below its data area
+const size_t printSampleSize = 1 << 16;      // decoded instructions kept for the printer timing
+
+struct BenchResult
+{
+    string input;
+    size_t bytes = 0;
+    long long decoded = 0;      // instructions in one linear sweep of the input
+    double decodeNs = 0;        // per decodeInstruction call
+    double decodeCycles = 0;
+    long long simulated = 0;    // instructions executed by one run, trace off
+    double simulateNs = 0;      // per emulated instruction, including fetch from the decode cache
+    double simulateCycles = 0;
+    double printNs = 0;         // per printCommand call, formatting into the output buffer
+    double printCycles = 0;
+    string error;               // empty when every stage finished
+};
+
+// Synthetic workload generator. Every effective address lands in 0xF180-0xFFFF (register pairs
+// wrap around 64 KB), so code below 0xF000 simulates without storing into itself. Every jump
+// except a loop's back edge goes forward, so generated programs always finish
+const int maxGeneratedLoopDepth = 3;         // one counter register per level: cx, dx, sp
+const size_t maxGeneratedItemSize = 20;      // a Jcc skipping three 6-byte instructions
+const size_t maxGeneratedInstructionSize = 6;
+const size_t minGeneratedLoopSize = 40;
+const int generatedBx = 0xF800;              // address registers, si and di get a random low byte
+const int generatedBp = 0xF900;
+const int generatedSi = 0xFA00;
+const int generatedDi = 0xFB00;
+const int generatedDispRange = 0x400;        // 16-bit displacements
+const int generatedDirect = 0xFC00;          // direct addresses
+const int generatedDirectSize = 0x200;
+
+struct GeneratorConfig
+{
+    uint64_t seed = 1;
+    size_t size = 1 << 16;       // upper bound on the program size in bytes
+    int movWeight = 4;           // relative frequency of each kind of item
+    int arithWeight = 4;
+    int jumpWeight = 1;
+    int loopWeight = 1;
+    int loopDepth = 2;           // deepest loop nest, up to maxGeneratedLoopDepth
+    double memoryDensity = 0.25; // share of mov/add/sub/cmp with a memory operand
+};
+
+struct Generator
+{
+    GeneratorConfig config;
+    uint64_t state = 0;
+    vector<u8> code;
+    int reserved = 0;            // bit per word register holding a live loop counter
+    int depth = 0;
+};
+
+// Basic block translation
+enum class Engine
+{
+    interpreter,
+    blocks,
+    threaded,
+    jit
+};
+
+enum MicroOpKind : u8
+{
+    uop_mov_reg16_imm,
+    uop_mov_reg8_imm,
+    uop_mov_reg16_reg16,
+    uop_mov_reg8_reg8,
+    uop_mov_reg16_mem,
+    uop_mov_reg8_mem,
+    uop_mov_mem_reg16,
+    uop_mov_mem_reg8,
+    uop_mov_mem_imm16,
+    uop_mov_mem_imm8,
+    uop_add_reg16_reg16, // add/sub/cmp keep this four form order
+    uop_add_reg8_reg8,
+    uop_add_reg16_imm,
+    uop_add_reg8_imm,
+    uop_sub_reg16_reg16,
+    uop_sub_reg8_reg8,
+    uop_sub_reg16_imm,
+    uop_sub_reg8_imm,
+    uop_cmp_reg16_reg16,
+    uop_cmp_reg8_reg8,
+    uop_cmp_reg16_imm,
+    uop_cmp_reg8_imm,
+    uop_jcc,             // any 0x70-0x7F jump, through conditionTable
+    uop_loop,
+    uop_loopz,
+    uop_loopnz,
+    uop_jcxz,
+    uop_generic,
+    uop_block_end        // closes a block that doesn't end in a jump
+};
+
+struct MicroOp
+{
+    MicroOpKind kind;
+    Mnemonic mnemonic;
+    WFlag w;
+    u8 dest;        // register file byte offset written, as decoded
+    u8 source;      // register file byte offset read
+    i8 base;        // effective address register slots, zeroSlot if unused
+    i8 index;
+    i8 segment;     // segment register slot of a memory operand
+    int disp;
+    int data;       // immediate data, branch displacement, or the decodeCache address of a uop_generic
+    int next;       // address of the following instruction
+    u8 condition;   // conditionTable entry of a uop_jcc
+    const void *handler; // threaded engine label for this kind
+};
+
+static_assert(sizeof(MicroOp) == 32, "micro-ops are packed 2 to a cache line");
+
+// The JIT stores the lazy flags record's mnemonic and width with byte moves
+static_assert((sizeof(Mnemonic) == 1) && (sizeof(WFlag) == 1), "JIT expects 8-bit enums");
+
+struct Block;
+
+// Exit taken by compiled code and the block it left from, native blocks chain into each other
+struct JitExit
+{
+    long long exit;
+    Block *block;
+};
+
+// Native code for a block: (regSlots, memory, flags, executed counter, count it chains until) -> exit taken
+typedef JitExit (*JitFunction)(i16 *regs, Memory *memory, Flags *flag, long long *executed, long long chainUntil);
+
+// Mapped once per thread and reused by every run on it, runs compile after the code earlier ones left
+struct JitBuffer
+{
+    u8 *code = nullptr;  // mmap'd read/write, pages holding code are switched to read/execute
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t sealed = 0;   // pages below are read/execute, the ones above read/write
+
+    ~JitBuffer();
+};
+
+// Executions of a block before the JIT compiles it, linked blocks with half as many are compiled with it.
+// Compiling a block costs about as much as a few hundred threaded runs of it, so only code that keeps
+// running goes native
+const int jitThreshold = 256;
+
+// Entries of a block before it is translated, it runs on the switch engine until then. A translation
+// only pays back over dozens of executions, fewer lose to plain interpretation
+const int translateThreshold = 64;
+
+// Micro-ops reserved per block, most blocks are shorter
+const int blockReserve = 16;
+
+// Error raised inside a helper called from compiled code, rethrown once the block returns
+thread_local exception_ptr jitError;
+
+struct Block
+{
+    int start;
+    int end;                       // address after the terminating instruction
+    vector<MicroOp> ops;
+    vector<string> text;           // disassembly of each op, rendered at translation when tracing
+    Block *next[2] = {};           // chained successors: [0] falls through, [1] branch taken
+    int hits = 0;                  // executions so far, for the JIT
+    JitFunction native = nullptr;
 };
 
 // Register & flags list
 string regList[13] = {"ax", "bx", "cx", "dx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds", "ip"};
-string flagsList[16] = {"", "", "", "", "O", "D", "I", "T", "S", "Z", "", "A", "", "P", "", "C"};
-int flagsListMask[9] = {4, 5, 6, 7, 8, 9, 11, 13, 15};
+string flagsList[16] = {"C", "", "P", "", "A", "", "Z", "S", "T", "I", "D", "O", "", "", "", ""};
+int flagsListMask[9] = {11, 10, 9, 8, 7, 6, 4, 2, 0};
+
+// FLAGS bits
+const u16 flagCF = 1 << 0;
+const u16 flagPF = 1 << 2;
+const u16 flagAF = 1 << 4;
+const u16 flagZF = 1 << 6;
+const u16 flagSF = 1 << 7;
+const u16 flagTF = 1 << 8;
+const u16 flagIF = 1 << 9;
+const u16 flagDF = 1 << 10;
+const u16 flagOF = 1 << 11;
+
+// Names for the formatter, indexed by enum value
+const string_view rmNames[(int)RM::not_set + 1] = {
+    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "bx + si", "bx + di", "bp + si", "bp + di", "",
+    "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx",
+    "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx",
+    "unknown"};
+const string_view rmPlusNames[(int)RM::not_set + 1] = {
+    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "bx + si", "bx + di", "bp + si", "bp + di", "",
+    "bx + si +", "bx + di +", "bp + si +", "bp + di +", "si +", "di +", "bp +", "bx +",
+    "bx + si +", "bx + di +", "bp + si +", "bp + di +", "si +", "di +", "bp +", "bx +",
+    "unknown"};
+const string_view srNames[4] = {"cs", "ds", "es", "ss"};
+const string_view wNames[3] = {"byte", "not specified", "word"};
+const string_view mnemonicNames[sub + 1] = {
+    "add", "cmp", "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js", "jne", "jnl",
+    "jg", "jnb", "ja", "jnp", "jno", "jns", "loop", "loopz", "loopnz", "jcxz", "mov", "sub"};
+
+// Register/memory operands by reg or rm field
+constexpr RM regWordRM[8] = {RM::ax, RM::cx, RM::dx, RM::bx, RM::sp, RM::bp, RM::si, RM::di};
+constexpr RM regByteRM[8] = {RM::al, RM::cl, RM::dl, RM::bl, RM::ah, RM::ch, RM::dh, RM::bh};
+constexpr RM memoryRM[3][8] = {
+    {RM::bx_plus_si, RM::bx_plus_di, RM::bp_plus_si, RM::bp_plus_di, RM::si, RM::di, RM::direct_address, RM::bx},
+    {RM::bx_plus_si_plus8, RM::bx_plus_di_plus8, RM::bp_plus_si_plus8, RM::bp_plus_di_plus8, RM::si_plus8, RM::di_plus8, RM::bp_plus8, RM::bx_plus8},
+    {RM::bx_plus_si_plus16, RM::bx_plus_di_plus16, RM::bp_plus_si_plus16, RM::bp_plus_di_plus16, RM::si_plus16, RM::di_plus16, RM::bp_plus16, RM::bx_plus16}};
+const SR segRegSR[4] = {SR::es, SR::cs, SR::ss, SR::ds};
+
+// Register file byte offset of each register operand, indexed by RM
+constexpr u8 regOffsets[(int)RM::di + 1] = {0, 4, 6, 2, 1, 5, 7, 3, 0, 4, 6, 2, 8, 10, 12, 14};
 
 // Masks
 const int singBitConv = 0b00000001;
@@ -251,1245 +698,4646 @@ const int highBitsMask = 0b1111111100000000;
 const int lowBitsMask = 0b0000000011111111;
 const int sixteenBitMask = 0b1111111111111111;
 
-// Function prototypes
-instruction getInstructionType(char buffer[], int i);
-void getW(char buffer[], int j, instruction &inst1);
-void getS(char buffer[], int j, instruction &inst1);
-void getRM(char buffer[], int j, instruction &inst1);
-void getREG(char buffer[], int j, instruction &inst1);
-void getDisp(char buffer[], int j, instruction &inst1, DispFlag &d);
-void getData(char buffer[], int j, instruction &inst1, DispFlag d);
-void getSourceAndDest(instruction &inst1);
-int getSize(instruction &inst1);
-void printCommand(instruction &inst1, DispFlag d);
-void emulateCommand(instruction inst, CPU &cpu, Memory &memory, Flags &flag);
-void printOperation(instruction inst1, CPU cpu);
-string enumRMToString(RM rm, int d);
-string enumSRToString(SR sr);
-string enumWToString(WFlag w);
-string enumMnemonicToString(Mnemonic m);
-int getCPUSlotRM(RM ax, Lo_Hi_Byte &lo);
-int getCPUMem(instruction inst1, RM ax, CPU cpu);
-int getCPUSlotSR(SR es);
-void setFlags(instruction inst, i32 destVal, i32 source, Flags &flag);
-void printFlags(Flags &flag);
-
-int main(int argc, char* argv[])
+// ModRM decode table, one entry per ModRM byte
+struct ModRMInfo
 {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <file_path>\n";
-        return 1;
-    }
+    MOD mode;
+    i8 reg;                  // reg field
+    i8 rm;                   // rm field
+    i8 dispSize;             // displacement bytes following the ModRM byte
+    i8 base;                 // effective address register slots, zeroSlot if unused
+    i8 index;
+    i8 segment;              // default segment register slot, ss for bp based addresses, otherwise ds
+    RM regOperand[2];        // reg field operand, indexed by W
+    RM rmOperand[2];         // register or effective address named by mod and rm, indexed by W
+};
 
-    std::string filePath = argv[1];
-    
-    ifstream inputFile;
+struct ModRMTable
+{
+    ModRMInfo entries[256];
+};
 
-    // open file
-    inputFile.open(filePath, ios::in | ios::binary);
+constexpr ModRMTable buildModRMTable()
+{
+    // Effective address registers by rm field: bx + si, bx + di, bp + si, bp + di, si, di, bp, bx
+    const i8 bases[8] = {1, 1, 5, 5, 6, 7, 5, 1};
+    const i8 indexes[8] = {6, 7, 6, 7, zeroSlot, zeroSlot, zeroSlot, zeroSlot};
 
-    if (!inputFile)
+    ModRMTable table = {};
+    for (int i = 0; i < 256; i++)
     {
-        cout << "Error opening file" << endl;
-    }
-
-    // Determine number of bytes in file
-    inputFile.seekg(0, ios::end);
-    int fileSize = inputFile.tellg();
-    inputFile.seekg(0, ios::beg);
-
-    // Create array to store each byte of data and read in data
-    char *buffer = new char[fileSize];
-    inputFile.read(buffer, fileSize);
-
-    // Create simulated CPU & flags
-    CPU registers;
-    Flags flag;
-    Memory memory;
+        ModRMInfo &entry = table.entries[i];
+        entry.mode = (MOD)((i >> 6) & twoBitConv);
+        entry.reg = (i >> 3) & threeBitconv;
+        entry.rm = i & threeBitconv;
+        entry.regOperand[0] = regByteRM[entry.reg];
+        entry.regOperand[1] = regWordRM[entry.reg];
+        entry.base = zeroSlot;
+        entry.index = zeroSlot;
+        entry.segment = 11;
+        if (entry.mode == register_mode)
+        {
+            entry.rmOperand[0] = regByteRM[entry.rm];
+            entry.rmOperand[1] = regWordRM[entry.rm];
+            continue;
+        }
 
-    // Decompile and print instruction
-    while (registers.regSlots[12] < fileSize)
-    {
-        instruction command = getInstructionType(buffer, registers.regSlots[12]);
-        DispFlag d = DispFlag::No_Displacement;
-        getW(buffer, registers.regSlots[12], command);
-        auto source = RM::not_set;
-        auto dest = RM::not_set;
-        if (((command.mnemonic == add) || (command.mnemonic == sub) || (command.mnemonic == cmp)) && (command.op_tag == immediate_to_register_mem))
+        RM memory = memoryRM[entry.mode][entry.rm];
+        entry.rmOperand[0] = memory;
+        entry.rmOperand[1] = memory;
+        if (memory == RM::direct_address)
         {
-            getS(buffer, registers.regSlots[12], command);
+            entry.dispSize = 2;
+            continue;
         }
-        getRM(buffer, registers.regSlots[12], command);
-        getREG(buffer, registers.regSlots[12], command);
-        getDisp(buffer, registers.regSlots[12], command, d);
-        getData(buffer, registers.regSlots[12], command, d);
-        getSourceAndDest(command);
+        entry.dispSize = (entry.mode == memory_mode_8_bit) ? 1 : ((entry.mode == memory_mode_16_bit) ? 2 : 0);
+        entry.base = bases[entry.rm];
+        entry.index = indexes[entry.rm];
+        entry.segment = (entry.base == 5) ? 10 : 11;
+    }
+    return table;
+}
 
-        // Print instruction
-        printCommand(command, d);
+constexpr ModRMTable modRMTable = buildModRMTable();
 
-        int increment = getSize(command);
-        registers.regSlots[12] += increment;
+// Opcode decode table
+struct OpcodeInfo
+{
+    Operation op_tag;
+    Mnemonic mnemonic;
+    i8 wBit;                 // bit of the first byte holding W, -1 if always word
+    i8 dBit;                 // bit of the first byte holding D, -1 if none
+    i8 sBit;                 // bit of the first byte holding S, -1 if none
+    bool hasModRM;           // second byte is a mod/reg/rm byte
+    bool regSelectsMnemonic; // mnemonic comes from the reg field of the ModRM byte
+};
 
-        // Perform operation
-        emulateCommand(command, registers, memory, flag);
-    }
+struct OpcodeTable
+{
+    OpcodeInfo entries[256];
+};
 
-    // Print register states
-    cout << endl
-         << "Final Registers:" << endl;
-    for (int k = 0; k < 13; k++)
+constexpr OpcodeTable buildOpcodeTable()
+{
+    OpcodeTable table = {};
+    for (int i = 0; i < 256; i++)
     {
-        cout << regList[k] << ": " << registers.regSlots[k] << endl; // register ID and value
+        table.entries[i] = {unknown, mov, -1, -1, -1, false, false};
     }
 
-    // Print flag states
-    cout << endl
-         << "Final Flags: " << endl;
-    for (int l = 0; l < 9; l++)
+    // add/sub/cmp/mov register/memory to/from register
+    for (int i = 0; i < 4; i++)
     {
-        cout << flagsList[flagsListMask[l]] << ": " << flag.flags[flagsListMask[l]] << endl;
+        table.entries[0b00000000 + i] = {register_mem_to_from_register, add, 0, 1, -1, true, false};
+        table.entries[0b00101000 + i] = {register_mem_to_from_register, sub, 0, 1, -1, true, false};
+        table.entries[0b00111000 + i] = {register_mem_to_from_register, cmp, 0, 1, -1, true, false};
+        table.entries[0b10001000 + i] = {register_mem_to_from_register, mov, 0, 1, -1, true, false};
     }
 
-    delete[] buffer;
-    return 0;
-}
-
-instruction getInstructionType(char buffer[], int j)
-{
-    int test1 = (buffer[j] >> 1) & sevBitConv;
-    int test2 = (buffer[j] >> 2) & sixBitConv;
-    int test4 = (buffer[j] >> 4) & fourBitConv;
-    int byteTwoTest = (buffer[j + 1] >> 3) & threeBitconv;
-    Operation oper_tag;
-    Mnemonic mnemonic;
-
-    switch (buffer[j] & 0b11111111)
+    // add/sub/cmp immediate to accumulator
+    for (int i = 0; i < 2; i++)
     {
-    case 0b10001110:
-        oper_tag = register_mem_to_from_seg_register;
-        mnemonic = mov;
-        break;
-    case 0b10001100:
-        oper_tag = register_mem_to_from_seg_register;
-        mnemonic = mov;
-        break;
-    case 0b01110100:
-        oper_tag = conditional_jump;
-        mnemonic = je;
-        break;
-    case 0b01111100:
-        oper_tag = conditional_jump;
-        mnemonic = jl;
-        break;
-    case 0b01111110:
-        oper_tag = conditional_jump;
-        mnemonic = jle;
-        break;
-    case 0b01110010:
-        oper_tag = conditional_jump;
-        mnemonic = jb;
-        break;
-    case 0b01110110:
-        oper_tag = conditional_jump;
-        mnemonic = jbe;
-        break;
-    case 0b01111010:
-        oper_tag = conditional_jump;
-        mnemonic = jp;
-        break;
-    case 0b01110000:
-        oper_tag = conditional_jump;
-        mnemonic = jo;
-        break;
-    case 0b01111000:
-        oper_tag = conditional_jump;
-        mnemonic = js;
-        break;
-    case 0b01110101:
-        oper_tag = conditional_jump;
-        mnemonic = jne;
-        break;
-    case 0b01111101:
-        oper_tag = conditional_jump;
-        mnemonic = jnl;
-        break;
-    case 0b01111111:
-        oper_tag = conditional_jump;
-        mnemonic = jg;
-        break;
-    case 0b01110011:
-        oper_tag = conditional_jump;
-        mnemonic = jnb;
-        break;
-    case 0b01110111:
-        oper_tag = conditional_jump;
-        mnemonic = ja;
-        break;
-    case 0b01111011:
-        oper_tag = conditional_jump;
-        mnemonic = jnp;
-        break;
-    case 0b01110001:
-        oper_tag = conditional_jump;
-        mnemonic = jno;
-        break;
-    case 0b01111001:
-        oper_tag = conditional_jump;
-        mnemonic = jns;
-        break;
-    case 0b11100010:
-        oper_tag = conditional_jump;
-        mnemonic = loop;
-        break;
-    case 0b11100001:
-        oper_tag = conditional_jump;
-        mnemonic = loopz;
-        break;
-    case 0b11100000:
-        oper_tag = conditional_jump;
-        mnemonic = loopnz;
-        break;
-    case 0b11100011:
-        oper_tag = conditional_jump;
-        mnemonic = jcxz;
-        break;
+        table.entries[0b00000100 + i] = {immediate_to_register, add, 0, -1, -1, false, false};
+        table.entries[0b00101100 + i] = {immediate_to_register, sub, 0, -1, -1, false, false};
+        table.entries[0b00111100 + i] = {immediate_to_register, cmp, 0, -1, -1, false, false};
     }
 
-    switch (test1)
+    // add/sub/cmp immediate to register/memory, mnemonic chosen by the reg field
+    for (int i = 0; i < 4; i++)
     {
-    case 0b01100011:
-        mnemonic = mov;
-        oper_tag = immediate_to_register_mem;
-        break;
-    case 0b00100000:
-        oper_tag = immediate_to_register_mem;
-        switch (byteTwoTest)
-        {
-        case 0b00000101:
-            mnemonic = sub;
-            break;
-        case 0b00000011:
-            mnemonic = cmp;
-            break;
-        }
-        break;
-    case 0b01010000:
-        mnemonic = mov;
-        oper_tag = memory_to_acc_or_vv;
-        break;
-    case 0b00000010:
-        mnemonic = add;
-        oper_tag = immediate_to_register;
-        break;
-    case 0b00010110:
-        mnemonic = sub;
-        oper_tag = immediate_to_register;
-        break;
-    case 0b00011110:
-        mnemonic = cmp;
-        oper_tag = immediate_to_register;
-        break;
-    case 0b01010001:
-        mnemonic = mov;
-        oper_tag = memory_to_acc_or_vv;
-        break;
+        table.entries[0b10000000 + i] = {immediate_to_register_mem, add, 0, -1, 1, true, true};
     }
 
-    switch (test2)
+    // mov immediate to register/memory
+    table.entries[0b11000110] = {immediate_to_register_mem, mov, 0, -1, -1, true, false};
+    table.entries[0b11000111] = {immediate_to_register_mem, mov, 0, -1, -1, true, false};
+
+    // mov immediate to register
+    for (int i = 0; i < 16; i++)
     {
-    case 0b00100010:
-        mnemonic = mov;
-        oper_tag = register_mem_to_from_register;
-        break;
-    case 0b00000000:
-        mnemonic = add;
-        oper_tag = register_mem_to_from_register;
-        break;
-    case 0b00001010:
-        mnemonic = sub;
-        oper_tag = register_mem_to_from_register;
-        break;
-    case 0b00001110:
-        mnemonic = cmp;
-        oper_tag = register_mem_to_from_register;
-        break;
-    case 0b00100000:
-        oper_tag = immediate_to_register_mem;
-        switch (byteTwoTest)
-        {
-        case 0b00000000:
-            mnemonic = add;
-            break;
-        case 0b00000101:
-            mnemonic = sub;
-            break;
-        case 0b00000111:
-            mnemonic = cmp;
-            break;
-        }
-        break;
+        table.entries[0b10110000 + i] = {immediate_to_register, mov, 3, -1, -1, false, false};
     }
 
-    switch (test4)
+    // mov memory to/from accumulator
+    for (int i = 0; i < 4; i++)
     {
-    case 0b00001011:
-        mnemonic = mov;
-        oper_tag = immediate_to_register;
-        break;
+        table.entries[0b10100000 + i] = {memory_to_acc_or_vv, mov, 0, 1, -1, false, false};
     }
 
-    instruction inst1(buffer[j], oper_tag, mnemonic);
-    inst1.op_tag = oper_tag;
-    inst1.op_code = buffer[j];
-    inst1.byteTwo = buffer[j + 1];
+    // mov register/memory to/from segment register
+    table.entries[0b10001100] = {register_mem_to_from_seg_register, mov, -1, 1, -1, true, false};
+    table.entries[0b10001110] = {register_mem_to_from_seg_register, mov, -1, 1, -1, true, false};
 
-    if (inst1.op_tag == register_mem_to_from_seg_register)
+    // conditional jumps, indexed by the low nibble of 0x70-0x7F
+    const Mnemonic jumps[16] = {jo, jno, jb, jnb, je, jne, jbe, ja, js, jns, jp, jnp, jl, jnl, jle, jg};
+    for (int i = 0; i < 16; i++)
     {
-        switch (buffer[j] & lowBitsMask)
-        {
-        case 0b10001110:
-            inst1.reg_mem_to_from_seg_reg.d = segment_register_is_destination;
-            break;
-        case 0b10001100:
-            inst1.reg_mem_to_from_seg_reg.d = segment_register_is_source;
-            break;
-        }
+        table.entries[0b01110000 + i] = {conditional_jump, jumps[i], -1, -1, -1, false, false};
     }
 
-    if (inst1.op_tag == memory_to_acc_or_vv)
+    // loops and jcxz
+    table.entries[0b11100000] = {conditional_jump, loopnz, -1, -1, -1, false, false};
+    table.entries[0b11100001] = {conditional_jump, loopz, -1, -1, -1, false, false};
+    table.entries[0b11100010] = {conditional_jump, loop, -1, -1, -1, false, false};
+    table.entries[0b11100011] = {conditional_jump, jcxz, -1, -1, -1, false, false};
+
+    return table;
+}
+
+constexpr OpcodeTable opcodeTable = buildOpcodeTable();
+
+// Parity flag by low byte of a result, set when it has an even number of one bits
+struct ParityTable
+{
+    u16 entries[256];
+};
+
+constexpr ParityTable buildParityTable()
+{
+    ParityTable table = {};
+    for (int i = 0; i < 256; i++)
     {
-        switch (test1)
+        int ones = 0;
+        for (int bit = 0; bit < 8; bit++)
         {
-        case 0b01010000:
-            inst1.mem_to_acc.d = accumulator_is_destination;
-            break;
-        case 0b01010001:
-            inst1.mem_to_acc.d = accumulator_is_source;
-            break;
+            ones += (i >> bit) & singBitConv;
         }
+        table.entries[i] = (ones % 2 == 0) ? flagPF : 0;
     }
+    return table;
+}
+
+constexpr ParityTable parityTable = buildParityTable();
+
+// Jcc outcome by the low nibble of 0x70-0x7F: bit k of an entry says whether the jump is taken when
+// packFlags gives k. Even conditions test a flag combination, odd ones its inverse.
+struct ConditionTable
+{
+    u32 entries[16];
+};
 
-    if (inst1.op_tag == register_mem_to_from_register)
+constexpr ConditionTable buildConditionTable()
+{
+    ConditionTable table = {};
+    for (int condition = 0; condition < 16; condition++)
     {
-        int d_value = ((buffer[j] >> 1) & 1);
-        switch (d_value)
+        for (int k = 0; k < 32; k++)
         {
-        case 0:
-            inst1.reg_mem_to_from_reg.d = register_is_source;
-            break;
-        case 1:
-            inst1.reg_mem_to_from_reg.d = register_is_destination;
-            break;
+            bool cf = (k & 1) != 0;
+            bool pf = (k & 2) != 0;
+            bool zf = (k & 4) != 0;
+            bool sf = (k & 8) != 0;
+            bool of = (k & 16) != 0;
+            bool taken = false;
+            switch (condition >> 1)
+            {
+            case 0: // jo
+                taken = of;
+                break;
+            case 1: // jb
+                taken = cf;
+                break;
+            case 2: // je
+                taken = zf;
+                break;
+            case 3: // jbe
+                taken = cf || zf;
+                break;
+            case 4: // js
+                taken = sf;
+                break;
+            case 5: // jp
+                taken = pf;
+                break;
+            case 6: // jl
+                taken = sf != of;
+                break;
+            case 7: // jle
+                taken = zf || (sf != of);
+                break;
+            }
+            if (condition & 1)
+            {
+                taken = !taken;
+            }
+            table.entries[condition] |= (taken ? 1u : 0u) << k;
         }
     }
-
-    return inst1;
+    return table;
 }
 
-void getW(char buffer[], int j, instruction &inst1)
+constexpr ConditionTable conditionTable = buildConditionTable();
+
+// Mnemonics selected by the reg field of 0x80-0x83, only add/sub/cmp are supported
+const bool immGroupSupported[8] = {true, false, false, false, false, true, false, true};
+const Mnemonic immGroupMnemonic[8] = {add, add, add, add, add, sub, add, cmp};
+
+// Function prototypes
+void printFinalState(ostream &out, CPU &cpu, Flags &flag);
+bool openInput(const string &path, InputImage &image);
+int disassembleStream(istream &input);
+size_t fillRing(ByteRing &ring, istream &input);
+int disassembleParallel(const InputImage &image, int threads);
+void decodeChunk(const InputImage &image, DisasmChunk &chunk);
+void decodeAt(const InputImage &image, size_t pos, instruction &inst1);
+int runBatch(const vector<string> &inputs, const string &outDir, Engine engine, int threads, bool quiet, const RunLimits &limits);
+bool takeJob(vector<WorkQueue> &queues, int self, size_t &job);
+void runBatchJob(BatchJob &job, Engine engine, bool quiet, const RunLimits &limits);
+void closeInput(InputImage &image);
+const char *decodeInstruction(const char *cursor, instruction &inst1);
+const instruction &fetchInstruction(Memory &memory, int ip);
+i8 readMemory(Memory &memory, u32 segmentBase, int offset);
+void writeMemory(Memory &memory, u32 segmentBase, int offset, i8 value);
+void setSegment(CPU &cpu, int slot, i16 value);
+void printCommand(const instruction &inst1);
+size_t formatCommand(const instruction &inst1, char *line);
+int listedDisp(const instruction &inst1, i16 disp);
+char *appendOperand(char *cursor, RM rm, int disp, bool showDisp, int segment);
+char *appendSegment(char *cursor, int segment);
+char *appendText(char *cursor, string_view text);
+char *appendInt(char *cursor, long long value);
+void writeOutput(string_view text);
+void flushOutput();
+void loadProgram(Memory &memory, const char *buffer, int codeSize);
+long long runEngine(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace);
+long long runInterpreter(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace);
+long long runQuiet(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, RunLimits &limits);
+bool limitReached(RunLimits &limits, long long executed);
+long long runTimed(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, long long &clocks);
+ClockEstimate estimateClocks(const instruction &inst1, const CPU &cpu);
+ClockEstimate encodingClocks(const instruction &inst1, RM &memoryOperand, int &transfers);
+int addressPenalty(const instruction &inst1, int transfers, const CPU &cpu);
+int eaClocks(RM rm);
+int takenClocks(Mnemonic mnemonic);
+void printTimedCommand(const instruction &inst1, const ClockEstimate &estimate, long long total);
+long long runProfiled(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, Profile &profile);
+void countLoop(LoopCounter &counter, bool taken);
+void printProfile(ostream &out, Memory &memory, const Profile &profile, long long executed);
+long long runTraced(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, TraceWriter &writer);
+void writeTraceRecord(TraceWriter &writer, const u8 *bytes, int ip, int size, const CPU &after, u16 flags);
+void writeTrace(TraceWriter &writer, const void *data, size_t size);
+void flushTrace(TraceWriter &writer);
+int changedRegisters(const i16 *now, const i16 *previous);
+int lowestSetBit(int bits);
+u16 packTraceFlags(u16 flags);
+u16 unpackTraceFlags(uint32_t packed);
+u8 *putVarint(u8 *cursor, uint32_t value);
+uint32_t zigzag(int delta);
+int viewTrace(const string &path, const TraceFilter &filter);
+uint32_t getVarint(const u8 *&cursor, const u8 *end, bool &ok);
+int unzigzag(uint32_t value);
+void printTraceRecord(long long index, int ip, string_view text, const CPU &before, const CPU &after, u16 oldFlags, u16 flags);
+long long runBlocks(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, RunLimits *limits);
+void interpretCold(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, long long &executed, long long stopAt, vector<u8> &entries);
+void dropStaleBlocks(vector<Block *> &blocks, vector<Block *> &live, int first, int last);
+void releaseBlocks(vector<Block *> &live);
+Block *translateBlock(Memory &memory, int ip, int codeEnd, bool trace);
+MicroOp translateInstruction(const instruction &inst1, int ip);
+int executeBlock(Block *&block, CPU &cpu, Memory &memory, Flags &flag, bool trace, long long &executed, long long chainUntil);
+int executeThreaded(Block *&block, CPU &cpu, Memory &memory, Flags &flag, bool trace, long long *executed, long long chainUntil,
+                    const void *const **handlerTable);
+const void *const *threadedHandlerTable();
+void compileHotBlocks(JitBuffer &jit, Block &root, Memory &memory, bool trace);
+JitFunction compileBlock(JitBuffer &jit, Block &block, Memory &memory, bool trace);
+void sealJitBuffer(JitBuffer &jit);
+void recycleJitBuffer(JitBuffer &jit);
+void openJitBuffer(JitBuffer &jit);
+void closeJitBuffer(JitBuffer &jit);
+void jitTrace(const string *text);
+bool jitWrite(Memory *memory, int address, int value, int wide, u32 segmentBase);
+bool jitEmulate(const instruction *inst1, CPU *cpu, Memory *memory, Flags *flag);
+u16 jitReadFlags(Flags *flag);
+int packFlags(u16 value);
+bool conditionHolds(int condition, Flags &flag);
+bool branchTaken(Mnemonic mnemonic, int condition, CPU &cpu, Flags &flag);
+int jitCondition(Flags *flag, int condition);
+void benchmarkEngines(const char *buffer, size_t fileSize);
+int runBenchSuite(const vector<string> &inputs, const string &resultsPath);
+BenchResult benchInput(const string &name, const InputImage &image, int codeSize);
+void measure(const function<long long()> &run, double &ns, double &cycles);
+uint64_t readCycleCounter();
+int runGenerator(const string &path, const GeneratorConfig &config);
+bool parseMix(const string &text, GeneratorConfig &config);
+void generateProgram(const GeneratorConfig &config, vector<u8> &code);
+void generateItem(Generator &gen, size_t limit);
+void generateInstruction(Generator &gen);
+void generateMov(Generator &gen);
+void generateArith(Generator &gen);
+void generateSkip(Generator &gen);
+void generateLoop(Generator &gen, size_t limit);
+void emitRM(Generator &gen, int reg, bool memory, int w, bool destination);
+void emitData(Generator &gen, int value, bool wide);
+int pickWritable(Generator &gen, int w);
+int randomBelow(Generator &gen, int bound);
+bool randomChance(Generator &gen, double probability);
+uint64_t nextRandom(uint64_t &state);
+void writeBenchResults(ostream &out, const vector<BenchResult> &results);
+void emulateCommand(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag);
+void emulateMemoryArith(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag);
+void printOperation(const instruction &inst1, const CPU &cpu);
+i32 byteResult(Mnemonic mnemonic, i16 destination, int offset, i32 source, bool wrap);
+string_view enumRMToString(RM rm, int d);
+string_view enumSRToString(SR sr);
+string_view enumWToString(WFlag w);
+string_view enumMnemonicToString(Mnemonic m);
+u8 getRegOffset(RM rm);
+int getCPUMem(const instruction &inst1, const CPU &cpu);
+int getCPUSlotSR(SR es);
+void setFlags(Mnemonic mnemonic, WFlag w, i32 result, i32 source, Flags &flag);
+u16 readFlags(Flags &flag);
+bool testFlags(Flags &flag, u16 mask);
+u16 computeFlags(const Flags &flag);
+void printFlags(Flags &flag);
+u8 selectHandler(const instruction &inst1);
+void executeCommand(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag);
+
+// Emulation handlers specialized by mnemonic, operand form and width, so the common mov/add/sub/cmp
+// forms run without testing W or the form at run time. Entry 0 and the rarer encodings (segment
+// registers, the accumulator moves) stay on emulateCommand.
+enum OperandForm : u8
 {
-    int wide = -1;
-    switch (inst1.op_tag)
-    {
-    case immediate_to_register:
-        if (inst1.mnemonic == mov)
-        {
-            wide = ((buffer[j] >> 3) & 1);
-        }
-        else
-        {
-            wide = (buffer[j] & 1);
-        }
-        break;
-    case register_mem_to_from_register:
-    case immediate_to_register_mem:
-    case memory_to_acc_or_vv:
-        wide = (buffer[j] & 1);
-        break;
-    case register_mem_to_from_seg_register:
-        wide = 1;
-        break;
-    }
-    if (wide)
-    {
-        inst1.w = Word;
-    }
-    else
-    {
-        inst1.w = Byte;
-    }
+    form_reg_imm, // immediate_to_register
+    form_rm_imm,  // immediate_to_register_mem in register mode
+    form_mem_imm, // immediate_to_register_mem to memory
+    form_reg_reg, // register_mem_to_from_register in register mode
+    form_mem_reg, // register_mem_to_from_register to memory
+    form_reg_mem, // register_mem_to_from_register from memory
+    form_count
+};
+
+typedef void (*EmulateHandler)(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag);
+
+template <Mnemonic mnemonic, OperandForm form, bool wide>
+void emulateForm(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag);
+
+// mov, add, sub, cmp take slots 0 to 3
+constexpr int handlerIndex(int slot, OperandForm form, bool wide)
+{
+    return 1 + (slot * form_count + form) * 2 + (wide ? 1 : 0);
 }
 
-void getS(char buffer[], int j, instruction &inst1)
+struct EmulateTable
 {
-    int sVal = -1;
-    if (inst1.op_tag == immediate_to_register_mem)
-    {
-        if (inst1.w == Word)
-        {
-            sVal = ((buffer[j] >> 1) & 1);
-        }
-        else
-        {
-            sVal = 0;
-        }
-    }
-    inst1.imm_to_reg_mem.s = sVal;
+    EmulateHandler entries[handlerIndex(3, form_reg_mem, true) + 1];
+};
+
+template <Mnemonic mnemonic, OperandForm form>
+constexpr void addHandlers(EmulateTable &table, int slot)
+{
+    table.entries[handlerIndex(slot, form, false)] = &emulateForm<mnemonic, form, false>;
+    table.entries[handlerIndex(slot, form, true)] = &emulateForm<mnemonic, form, true>;
 }
 
-void getRM(char buffer[], int j, instruction &inst1)
+constexpr EmulateTable buildEmulateTable()
 {
-    MOD mode = (MOD)((buffer[j + 1] >> 6) & twoBitConv);
-    switch (inst1.op_tag)
+    EmulateTable table = {};
+    for (EmulateHandler &entry : table.entries)
     {
-    case register_mem_to_from_register:
-        inst1.reg_mem_to_from_reg.mod = mode;
-        break;
-    case immediate_to_register_mem:
-        inst1.imm_to_reg_mem.mod = mode;
-        break;
-    case register_mem_to_from_seg_register:
-        inst1.reg_mem_to_from_seg_reg.mod = mode;
-        break;
+        entry = &emulateCommand;
     }
+    addHandlers<mov, form_reg_imm>(table, 0);
+    addHandlers<mov, form_rm_imm>(table, 0);
+    addHandlers<mov, form_mem_imm>(table, 0);
+    addHandlers<mov, form_reg_reg>(table, 0);
+    addHandlers<mov, form_mem_reg>(table, 0);
+    addHandlers<mov, form_reg_mem>(table, 0);
+    addHandlers<add, form_reg_imm>(table, 1);
+    addHandlers<add, form_rm_imm>(table, 1);
+    addHandlers<add, form_reg_reg>(table, 1);
+    addHandlers<add, form_mem_imm>(table, 1);
+    addHandlers<add, form_mem_reg>(table, 1);
+    addHandlers<add, form_reg_mem>(table, 1);
+    addHandlers<sub, form_reg_imm>(table, 2);
+    addHandlers<sub, form_rm_imm>(table, 2);
+    addHandlers<sub, form_reg_reg>(table, 2);
+    addHandlers<sub, form_mem_imm>(table, 2);
+    addHandlers<sub, form_mem_reg>(table, 2);
+    addHandlers<sub, form_reg_mem>(table, 2);
+    addHandlers<cmp, form_reg_imm>(table, 3);
+    addHandlers<cmp, form_rm_imm>(table, 3);
+    addHandlers<cmp, form_reg_reg>(table, 3);
+    addHandlers<cmp, form_mem_imm>(table, 3);
+    addHandlers<cmp, form_mem_reg>(table, 3);
+    addHandlers<cmp, form_reg_mem>(table, 3);
+    return table;
+}
+
+constexpr EmulateTable emulateTable = buildEmulateTable();
 
-    if (inst1.op_tag == memory_to_acc_or_vv)
+int main(int argc, char* argv[])
+{
+    Engine engine = Engine::interpreter;
+    bool bench = false;
+    bool disasm = false;
+    bool batch = false;
+    bool benchSuite = false;
+    bool clocks = false;
+    bool profiling = false;
+    bool quiet = false;
+    RunLimits limits;
+    string tracePath;
+    string viewPath;
+    TraceFilter traceFilter;
+    string outDir = "batch_output";
+    string resultsPath = "bench_results.json";
+    string generatePath;
+    GeneratorConfig generator;
+    int threads = max(1u, thread::hardware_concurrency());
+    std::string filePath;
+    vector<string> inputs;
+    for (int a = 1; a < argc; a++)
     {
-        if (inst1.w == Word)
+        std::string arg = argv[a];
+        if (arg == "--engine=switch")
         {
-            inst1.mem_to_acc.address = ((buffer[j + 2] >> 8) & 0b1111111100000000) + (buffer[j + 1] & 0b0000000011111111);
+            engine = Engine::interpreter;
         }
-        else
+        else if (arg == "--engine=blocks")
         {
-            inst1.mem_to_acc.address = buffer[j + 1];
+            engine = Engine::blocks;
         }
-    }
-    else
-    {
-        int rm1 = (buffer[j + 1] & threeBitconv);
-        RM rmConv = RM::not_set;
-        switch (mode)
+        else if (arg == "--engine=threaded")
         {
-        case memory_mode:
-            switch (rm1)
-            {
-            case 0:
-                rmConv = RM::bx_plus_si;
-                break;
-            case 1:
-                rmConv = RM::bx_plus_di;
-                break;
-            case 2:
-                rmConv = RM::bp_plus_si;
-                break;
-            case 3:
-                rmConv = RM::bp_plus_di;
-                break;
-            case 4:
-                rmConv = RM::si;
-                break;
-            case 5:
-                rmConv = RM::di;
-                break;
-            case 6:
-                rmConv = RM::direct_address;
-                break;
-            case 7:
-                rmConv = RM::bx;
-                break;
-            }
-            break;
-        case memory_mode_8_bit:
-            switch (rm1)
-            {
-            case 0:
-                rmConv = RM::bx_plus_si_plus8;
-                break;
-            case 1:
-                rmConv = RM::bx_plus_di_plus8;
-                break;
-            case 2:
-                rmConv = RM::bp_plus_si_plus8;
-                break;
-            case 3:
-                rmConv = RM::bp_plus_di_plus8;
-                break;
-            case 4:
-                rmConv = RM::si_plus8;
-                break;
-            case 5:
-                rmConv = RM::di_plus8;
-                break;
-            case 6:
-                rmConv = RM::bp_plus8;
-                break;
-            case 7:
-                rmConv = RM::bx_plus8;
-                break;
-            }
-            break;
-        case memory_mode_16_bit:
-            switch (rm1)
-            {
-            case 0:
-                rmConv = RM::bx_plus_si_plus16;
-                break;
-            case 1:
-                rmConv = RM::bx_plus_di_plus16;
-                break;
-            case 2:
-                rmConv = RM::bp_plus_si_plus16;
-                break;
-            case 3:
-                rmConv = RM::bp_plus_di_plus16;
-                break;
-            case 4:
-                rmConv = RM::si_plus16;
-                break;
-            case 5:
-                rmConv = RM::di_plus16;
-                break;
-            case 6:
-                rmConv = RM::bp_plus16;
-                break;
-            case 7:
-                rmConv = RM::bx_plus16;
-                break;
-            }
-            break;
-        case register_mode:
-            if (inst1.w == Word)
-            {
-                switch (rm1)
-                {
-                case 0:
-                    rmConv = RM::ax;
-                    break;
-                case 1:
-                    rmConv = RM::cx;
-                    break;
-                case 2:
-                    rmConv = RM::dx;
-                    break;
-                case 3:
-                    rmConv = RM::bx;
-                    break;
-                case 4:
-                    rmConv = RM::sp;
-                    break;
-                case 5:
-                    rmConv = RM::bp;
-                    break;
-                case 6:
-                    rmConv = RM::si;
-                    break;
-                case 7:
-                    rmConv = RM::di;
-                    break;
-                }
-            }
-            else if (inst1.w == Byte)
-            {
-                switch (rm1)
-                {
-                case 0:
-                    rmConv = RM::al;
-                    break;
-                case 1:
-                    rmConv = RM::cl;
-                    break;
-                case 2:
-                    rmConv = RM::dl;
-                    break;
-                case 3:
-                    rmConv = RM::bl;
-                    break;
-                case 4:
-                    rmConv = RM::ah;
-                    break;
-                case 5:
-                    rmConv = RM::ch;
-                    break;
-                case 6:
-                    rmConv = RM::dh;
-                    break;
-                case 7:
-                    rmConv = RM::bh;
-                    break;
-                }
-            }
-            break;
+            engine = Engine::threaded;
         }
-        switch (inst1.op_tag)
+        else if (arg == "--engine=jit")
         {
-        case register_mem_to_from_register:
-            inst1.reg_mem_to_from_reg.rm = rmConv;
-            break;
-        case immediate_to_register_mem:
-            inst1.imm_to_reg_mem.rm = rmConv;
-            break;
-        case register_mem_to_from_seg_register:
-            inst1.reg_mem_to_from_seg_reg.rm = rmConv;
-            break;
+            engine = Engine::jit;
         }
-    }
-}
-
-void getREG(char buffer[], int j, instruction &inst1)
-{
-    int regist;
-    switch (inst1.op_tag)
-    {
-    case register_mem_to_from_register:
-        regist = ((buffer[j + 1] >> 3) & threeBitconv);
-        if (inst1.w == Word)
+        else if (arg == "--bench")
         {
-            switch (regist)
-            {
-            case 0:
-                inst1.reg_mem_to_from_reg.reg = RM::ax;
-                break;
-            case 1:
-                inst1.reg_mem_to_from_reg.reg = RM::cx;
-                break;
-            case 2:
-                inst1.reg_mem_to_from_reg.reg = RM::dx;
-                break;
-            case 3:
-                inst1.reg_mem_to_from_reg.reg = RM::bx;
-                break;
-            case 4:
-                inst1.reg_mem_to_from_reg.reg = RM::sp;
-                break;
-            case 5:
-                inst1.reg_mem_to_from_reg.reg = RM::bp;
-                break;
-            case 6:
-                inst1.reg_mem_to_from_reg.reg = RM::si;
-                break;
-            case 7:
-                inst1.reg_mem_to_from_reg.reg = RM::di;
-                break;
-            }
+            bench = true;
         }
-        else
+        else if (arg == "--clocks")
         {
-            switch (regist)
-            {
-            case 0:
-                inst1.reg_mem_to_from_reg.reg = RM::al;
-                break;
-            case 1:
-                inst1.reg_mem_to_from_reg.reg = RM::cl;
-                break;
-            case 2:
-                inst1.reg_mem_to_from_reg.reg = RM::dl;
-                break;
-            case 3:
-                inst1.reg_mem_to_from_reg.reg = RM::bl;
-                break;
-            case 4:
-                inst1.reg_mem_to_from_reg.reg = RM::ah;
-                break;
-            case 5:
-                inst1.reg_mem_to_from_reg.reg = RM::ch;
-                break;
-            case 6:
-                inst1.reg_mem_to_from_reg.reg = RM::dh;
-                break;
-            case 7:
-                inst1.reg_mem_to_from_reg.reg = RM::bh;
-                break;
-            }
+            clocks = true;
         }
-        break;
-    case immediate_to_register:
-        switch ((inst1.op_code >> 1) & sevBitConv)
+        else if (arg == "--profile")
         {
-        case 0b00000010:
-        case 0b00010110:
-            if (inst1.w == Word)
-            {
-                inst1.imm_to_reg.reg = RM::ax;
-            }
-            else
-            {
-                inst1.imm_to_reg.reg = RM::al;
-            }
-            break;
-        case 0b00011110:
-            inst1.imm_to_reg.reg = RM::al;
-            break;
-        default:
-            regist = buffer[j] & threeBitconv;
-            if (inst1.w == Word)
-            {
-                switch (regist)
-                {
-                case 0:
-                    inst1.imm_to_reg.reg = RM::ax;
-                    break;
-                case 1:
-                    inst1.imm_to_reg.reg = RM::cx;
-                    break;
-                case 2:
-                    inst1.imm_to_reg.reg = RM::dx;
-                    break;
-                case 3:
-                    inst1.imm_to_reg.reg = RM::bx;
-                    break;
-                case 4:
-                    inst1.imm_to_reg.reg = RM::sp;
-                    break;
-                case 5:
-                    inst1.imm_to_reg.reg = RM::bp;
-                    break;
-                case 6:
-                    inst1.imm_to_reg.reg = RM::si;
-                    break;
-                case 7:
-                    inst1.imm_to_reg.reg = RM::di;
-                    break;
-                }
-                break;
-            }
-            else
-            {
-                switch (regist)
-                {
-                case 0:
-                    inst1.imm_to_reg.reg = RM::al;
-                    break;
-                case 1:
-                    inst1.imm_to_reg.reg = RM::cl;
-                    break;
-                case 2:
-                    inst1.imm_to_reg.reg = RM::dl;
-                    break;
-                case 3:
-                    inst1.imm_to_reg.reg = RM::bl;
-                    break;
-                case 4:
-                    inst1.imm_to_reg.reg = RM::ah;
-                    break;
-                case 5:
-                    inst1.imm_to_reg.reg = RM::ch;
-                    break;
-                case 6:
-                    inst1.imm_to_reg.reg = RM::dh;
-                    break;
-                case 7:
-                    inst1.imm_to_reg.reg = RM::bh;
-                    break;
-                }
-            }
-            break;
+            profiling = true;
         }
-        break;
-    case register_mem_to_from_seg_register:
-        regist = ((buffer[j + 1] >> 3) & twoBitConv);
-        switch (regist)
+        else if (arg == "--quiet")
         {
-        case 0:
-            inst1.reg_mem_to_from_seg_reg.sr = SR::es;
-            break;
-        case 1:
-            inst1.reg_mem_to_from_seg_reg.sr = SR::cs;
-            break;
-        case 2:
-            inst1.reg_mem_to_from_seg_reg.sr = SR::ss;
-            break;
-        case 3:
-            inst1.reg_mem_to_from_seg_reg.sr = SR::ds;
-            break;
+            quiet = true;
         }
-        break;
-    };
-}
-
-void getDisp(char buffer[], int j, instruction &inst1, DispFlag &d)
-{
-    switch (inst1.op_tag)
-    {
-    case register_mem_to_from_register:
-        if (inst1.reg_mem_to_from_reg.mod == memory_mode_8_bit)
+        else if (arg.rfind("--max-instructions=", 0) == 0)
         {
-            inst1.reg_mem_to_from_reg.disp = buffer[j + 2];
-            d = DispFlag::Has_Displacement;
+            limits.maxInstructions = strtoll(arg.c_str() + 19, nullptr, 10);
         }
-        else if (inst1.reg_mem_to_from_reg.mod == memory_mode_16_bit)
+        else if (arg.rfind("--timeout=", 0) == 0)
         {
-            inst1.reg_mem_to_from_reg.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            limits.timeoutSeconds = atof(arg.c_str() + 10);
         }
-        else if ((inst1.reg_mem_to_from_reg.mod == memory_mode) && (inst1.reg_mem_to_from_reg.rm == RM::direct_address))
+        else if (arg.rfind("--trace=", 0) == 0)
         {
-            inst1.reg_mem_to_from_reg.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            tracePath = arg.substr(8);
         }
-        break;
-    case immediate_to_register_mem:
-        if (inst1.imm_to_reg_mem.mod == memory_mode_8_bit)
+        else if (arg.rfind("--view-trace=", 0) == 0)
         {
-            inst1.imm_to_reg_mem.disp = buffer[j + 2];
-            d = DispFlag::Has_Displacement;
+            viewPath = arg.substr(13);
         }
-        else if (inst1.imm_to_reg_mem.mod == memory_mode_16_bit)
+        else if (arg.rfind("--ip=", 0) == 0)
         {
-            inst1.imm_to_reg_mem.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            // Single address or first-last
+            size_t dash = arg.find('-', 5);
+            traceFilter.first = strtol(arg.c_str() + 5, nullptr, 0);
+            traceFilter.last = (dash == string::npos) ? traceFilter.first : strtol(arg.c_str() + dash + 1, nullptr, 0);
         }
-        else if ((inst1.imm_to_reg_mem.mod == memory_mode) && (inst1.imm_to_reg_mem.rm == RM::direct_address))
+        else if (arg.rfind("--match=", 0) == 0)
         {
-            inst1.imm_to_reg_mem.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            traceFilter.match = arg.substr(8);
         }
-
-        break;
-    case register_mem_to_from_seg_register:
-        if (inst1.reg_mem_to_from_seg_reg.mod == memory_mode_8_bit)
+        else if (arg == "--bench-suite")
         {
-            inst1.reg_mem_to_from_seg_reg.disp = buffer[j + 2];
-            d = DispFlag::Has_Displacement;
+            benchSuite = true;
         }
-        else if (inst1.reg_mem_to_from_seg_reg.mod == memory_mode_16_bit)
+        else if (arg.rfind("--results=", 0) == 0)
         {
-            inst1.reg_mem_to_from_seg_reg.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            resultsPath = arg.substr(10);
         }
-        else if ((inst1.reg_mem_to_from_seg_reg.mod == memory_mode) && (inst1.reg_mem_to_from_seg_reg.rm == RM::direct_address))
+        else if (arg.rfind("--generate=", 0) == 0)
         {
-            inst1.reg_mem_to_from_seg_reg.disp = ((buffer[j + 3] << 8) & highBitsMask) + (buffer[j + 2] & lowBitsMask);
-            d = DispFlag::Has_Displacement;
+            generatePath = arg.substr(11);
         }
-        break;
-    }
-}
-
-void getData(char buffer[], int j, instruction &inst1, DispFlag d)
-{
-    int offset = 0;
-    switch (inst1.op_tag)
-    {
-    case immediate_to_register_mem:
-        if (d == DispFlag::No_Displacement)
+        else if (arg.rfind("--seed=", 0) == 0)
         {
-            offset = 2;
+            generator.seed = strtoull(arg.c_str() + 7, nullptr, 10);
         }
-        else
+        else if (arg.rfind("--size=", 0) == 0)
         {
-            switch (inst1.imm_to_reg_mem.mod)
-            {
-            case 0:
-                if (inst1.imm_to_reg_mem.rm != RM::direct_address)
-                {
-                    offset = 2;
-                }
-                else
-                {
-                    offset = 4;
-                }
-                break;
-            case 3:
-                offset = 2;
-                break;
-            case 1:
-                offset = 3;
-                break;
-            case 2:
-                offset = 4;
-                break;
-            }
+            generator.size = strtoull(arg.c_str() + 7, nullptr, 10);
         }
-        if (inst1.w == Word)
+        else if (arg.rfind("--mix=", 0) == 0)
         {
-            if ((inst1.mnemonic == add) || (inst1.mnemonic == sub) || (inst1.mnemonic == cmp))
-            {
-                if (inst1.imm_to_reg_mem.s == 0)
-                {
-                    inst1.imm_to_reg_mem.data = (static_cast<int16_t>((buffer[j + offset + 1] << 8) & highBitsMask) + (buffer[j + offset] & lowBitsMask));
-                }
-                else
-                {
-                    inst1.imm_to_reg_mem.data = static_cast<int16_t>(buffer[j + offset]);
-                }
-            }
-            else
+            if (!parseMix(arg.substr(6), generator))
             {
-                inst1.imm_to_reg_mem.data = (static_cast<int16_t>((buffer[j + offset + 1] << 8) & highBitsMask) + (buffer[j + offset] & lowBitsMask));
+                std::cerr << "Invalid mix, expected e.g. mov:4,arith:4,jump:1,loop:1\n";
+                return 1;
             }
         }
-        else
+        else if (arg.rfind("--loop-depth=", 0) == 0)
         {
-            inst1.imm_to_reg_mem.data = static_cast<int16_t>(buffer[j + offset]);
+            generator.loopDepth = atoi(arg.c_str() + 13);
         }
-        break;
-    case immediate_to_register:
-        if (inst1.w == Word)
+        else if (arg.rfind("--memory-density=", 0) == 0)
         {
-            inst1.imm_to_reg.data = (static_cast<int16_t>((buffer[j + 2] << 8) & highBitsMask) + (buffer[j + 1] & lowBitsMask));
+            generator.memoryDensity = atof(arg.c_str() + 17);
         }
-        else
+        else if (arg == "--disasm")
         {
-            inst1.imm_to_reg.data = static_cast<int16_t>(buffer[j + 1]);
+            disasm = true;
         }
-        break;
-    case conditional_jump:
-        inst1.cond_jmp.data = static_cast<int16_t>(buffer[j + 1]);
-        break;
-    }
-}
+        else if (arg.rfind("--threads=", 0) == 0)
+        {
+            threads = max(1, atoi(arg.c_str() + 10));
+        }
+        else if (arg == "--batch")
+        {
+            batch = true;
+        }
+        else if (arg.rfind("--out=", 0) == 0)
+        {
+            outDir = arg.substr(6);
+        }
+        else
+        {
+            filePath = arg;
+            inputs.push_back(arg);
+        }
+    }
 
-int getSize(instruction &inst1)
-{
-    bool sMnemonic = (inst1.mnemonic == add) || (inst1.mnemonic == sub) || (inst1.mnemonic == cmp);
-    switch (inst1.op_tag)
+    // Write a generated program instead of running one
+    if (!generatePath.empty())
     {
-    case register_mem_to_from_register:
-        switch (inst1.reg_mem_to_from_reg.mod)
+        return runGenerator(generatePath, generator);
+    }
+
+    // Render a binary trace written by an earlier --trace run
+    if (!viewPath.empty())
+    {
+        return viewTrace(viewPath, traceFilter);
+    }
+
+    if (filePath.empty() && !benchSuite) {
+        std::cerr << "Usage: " << argv[0] << " [--engine=switch|blocks|threaded|jit] [--clocks] [--profile] [--trace=FILE] [--quiet [--max-instructions=N] [--timeout=SECONDS]] [--bench] [--disasm [--threads=N]] <file_path|->\n"
+                  << "       " << argv[0] << " --batch [--engine=...] [--threads=N] [--out=DIR] [--quiet ...] <file|directory>...\n"
+                  << "       " << argv[0] << " --view-trace=FILE [--ip=FIRST-LAST] [--match=TEXT]\n"
+                  << "       " << argv[0] << " --bench-suite [--results=FILE] [file...]\n"
+                  << "       " << argv[0] << " --generate=FILE [--seed=N] [--size=BYTES] [--mix=mov:4,arith:4,jump:1,loop:1] [--loop-depth=N] [--memory-density=F]\n";
+        return 1;
+    }
+
+    // Decoder, simulator and printer timed separately over the inputs and synthetic streams
+    if (benchSuite)
+    {
+        return runBenchSuite(inputs, resultsPath);
+    }
+
+    // Many listings in one process, each with its own output files
+    if (batch)
+    {
+        return runBatch(inputs, outDir, engine, threads, quiet, limits);
+    }
+
+    // Disassembly only. Files are split across threads, stdin is streamed through a fixed size buffer
+    if (disasm)
+    {
+        if (filePath == "-")
         {
-        case 0:
-            if (inst1.reg_mem_to_from_reg.rm != RM::direct_address)
+            return disassembleStream(cin);
+        }
+
+        if (threads > 1)
+        {
+            InputImage image;
+            if (!openInput(filePath, image))
             {
-                return 2;
+                cout << "Error opening file" << endl;
+                return 1;
             }
-            else
+            int status = disassembleParallel(image, threads);
+            closeInput(image);
+            return status;
+        }
+
+        ifstream inputFile(filePath, ios::in | ios::binary);
+        if (!inputFile)
+        {
+            cout << "Error opening file" << endl;
+            return 1;
+        }
+        return disassembleStream(inputFile);
+    }
+
+    // Map the file, or read it when it's a pipe or '-' for stdin
+    InputImage image;
+    if (!openInput(filePath, image))
+    {
+        cout << "Error opening file" << endl;
+        return 1;
+    }
+
+    if (bench)
+    {
+        benchmarkEngines(image.data, image.size);
+        closeInput(image);
+        return 0;
+    }
+
+    // Create simulated CPU & flags, and load the program at address 0
+    CPU registers;
+    Flags &flag = registers.flag;
+    Memory memory;
+    int codeSize = min(image.size, (size_t)65536);
+    loadProgram(memory, image.data, codeSize);
+
+    // Decompile, print and simulate the program, with a clock estimate per line when asked
+    long long totalClocks = 0;
+    long long executed = 0;
+    Profile profile;
+    try
+    {
+        if (!tracePath.empty())
+        {
+            ofstream traceFile(tracePath, ios::out | ios::binary);
+            if (!traceFile)
             {
-                return 4;
+                cout << "Error opening output" << endl;
+                closeInput(image);
+                return 1;
             }
-            break;
-        case 3:
-            return 2;
-            break;
-        case 1:
-            return 3;
-            break;
-        case 2:
-            return 4;
+            TraceWriter writer;
+            writer.out = &traceFile;
+            try
+            {
+                executed = runTraced(registers, memory, flag, codeSize, writer);
+            }
+            catch (const exception &)
+            {
+                flushTrace(writer);
+                throw;
+            }
+            flushTrace(writer);
+        }
+        else if (profiling)
+        {
+            executed = runProfiled(registers, memory, flag, codeSize, true, profile);
+            totalClocks = profile.totalClocks;
+        }
+        else if (clocks)
+        {
+            runTimed(registers, memory, flag, codeSize, true, totalClocks);
+        }
+        else if (quiet)
+        {
+            runQuiet(engine, registers, memory, flag, codeSize, limits);
+        }
+        else
+        {
+            runEngine(engine, registers, memory, flag, codeSize, true);
+        }
+    }
+    catch (const exception &failure)
+    {
+        flushOutput();
+        cout << failure.what() << endl;
+        closeInput(image);
+        return 1;
+    }
+
+    flushOutput();
+    if (clocks)
+    {
+        cout << endl
+             << "Estimated clocks: " << totalClocks << endl;
+    }
+    if (!limits.stopped.empty())
+    {
+        cout << limits.stopped << endl;
+    }
+    printFinalState(cout, registers, flag);
+    if (profiling)
+    {
+        printProfile(cout, memory, profile, executed);
+    }
+
+    closeInput(image);
+    return limits.stopped.empty() ? 0 : 1;
+}
+
+bool openInput(const string &path, InputImage &image)
+{
+#if defined(__unix__)
+    int fd = (path == "-") ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Regular files are mapped so nothing is copied up front and the pages are shared between processes
+    struct stat info;
+    if ((fstat(fd, &info) == 0) && S_ISREG(info.st_mode) && (info.st_size > 0))
+    {
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            image.mapping = mapping;
+            image.data = static_cast<const char *>(mapping);
+            image.size = info.st_size;
+            if (fd != STDIN_FILENO)
+            {
+                close(fd);
+            }
+            return true;
+        }
+    }
+
+    // Pipes and other unmappable inputs are read in chunks until end of file
+    char chunk[65536];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        image.storage.insert(image.storage.end(), chunk, chunk + count);
+    }
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    if (count < 0)
+    {
+        return false;
+    }
+#else
+    ifstream inputFile;
+    istream *input = &cin;
+    if (path != "-")
+    {
+        inputFile.open(path, ios::in | ios::binary);
+        if (!inputFile)
+        {
+            return false;
+        }
+        input = &inputFile;
+    }
+    image.storage.assign(istreambuf_iterator<char>(*input), istreambuf_iterator<char>());
+#endif
+    image.data = image.storage.data();
+    image.size = image.storage.size();
+    return true;
+}
+
+int disassembleStream(istream &input)
+{
+    ByteRing ring;
+    const size_t mask = streamRingSize - 1;
+    char window[maxInstructionSize];
+    instruction command(unknown);
+    while (true)
+    {
+        // Keep at least one full instruction buffered unless the input has ended
+        if ((ring.end - ring.start < (uint64_t)maxInstructionSize) && !ring.eof)
+        {
+            fillRing(ring, input);
+            continue;
+        }
+        if (ring.start == ring.end)
+        {
             break;
         }
-        break;
-    case immediate_to_register_mem:
-        switch (inst1.imm_to_reg_mem.mod)
+
+        // Decode in place, or from a copy when the instruction wraps or runs into the end of the input
+        size_t offset = ring.start & mask;
+        size_t available = ring.end - ring.start;
+        const char *cursor = &ring.bytes[offset];
+        if ((offset + maxInstructionSize > streamRingSize) || (available < (size_t)maxInstructionSize))
         {
-        case 0:
-            if (inst1.imm_to_reg_mem.rm != RM::direct_address)
+            for (int k = 0; k < maxInstructionSize; k++)
             {
-                switch (inst1.w)
-                {
-                case Word:
-                    if (sMnemonic)
-                    {
-                        if (inst1.imm_to_reg_mem.s == 0)
-                        {
-                            return 4;
-                        }
-                        else
-                        {
-                            return 3;
-                        }
-                    }
-                    else
-                    {
-                        return 4;
-                    }
-                case Byte:
-                    return 3;
-                    break;
-                }
+                window[k] = ((size_t)k < available) ? ring.bytes[(offset + k) & mask] : 0;
             }
-            else
+            cursor = window;
+        }
+
+        decodeInstruction(cursor, command);
+        if (command.op_tag == unknown)
+        {
+            flushOutput();
+            cout << "Invalid Optag" << endl;
+            return 1;
+        }
+        if ((size_t)command.size > available)
+        {
+            flushOutput();
+            cout << "Truncated instruction at offset " << ring.start << endl;
+            return 1;
+        }
+
+        printCommand(command);
+        ring.start += command.size;
+    }
+    flushOutput();
+    return 0;
+}
+
+size_t fillRing(ByteRing &ring, istream &input)
+{
+    // Read into the free space up to the wrap point, the next call continues from the front
+    size_t offset = ring.end & (streamRingSize - 1);
+    size_t space = streamRingSize - (ring.end - ring.start);
+    size_t count = min(space, streamRingSize - offset);
+    input.read(&ring.bytes[offset], count);
+    size_t got = input.gcount();
+    ring.end += got;
+    if (got == 0)
+    {
+        ring.eof = true;
+    }
+    return got;
+}
+
+int disassembleParallel(const InputImage &image, int threads)
+{
+    vector<DisasmChunk> chunks(threads);
+    size_t pos = 0;
+    for (size_t roundStart = 0; roundStart < image.size; roundStart += threads * disasmChunkSize)
+    {
+        // Each thread decodes its chunk as if an instruction started at the first byte
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++)
+        {
+            chunks[t].begin = min(image.size, roundStart + t * disasmChunkSize);
+            chunks[t].end = min(image.size, chunks[t].begin + disasmChunkSize);
+            workers.emplace_back(decodeChunk, cref(image), ref(chunks[t]));
+        }
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        // Stitch in order, decoding here until the real instruction stream lines up with a chunk's guess
+        for (DisasmChunk &chunk : chunks)
+        {
+            while (pos < chunk.end)
             {
-                switch (inst1.w)
+                auto found = lower_bound(chunk.starts.begin(), chunk.starts.end(), pos);
+                if ((found != chunk.starts.end()) && (*found == pos))
                 {
-                case Word:
-                    if (sMnemonic)
+                    // Decoding is deterministic from here on, so the rest of that run is what we'd print
+                    size_t index = found - chunk.starts.begin();
+                    const DisasmRun &run = *upper_bound(chunk.runs.begin(), chunk.runs.end(), index,
+                                                        [](size_t i, const DisasmRun &r) { return i < r.last; });
+                    size_t first = chunk.text[index];
+                    size_t last = (run.last < chunk.text.size()) ? chunk.text[run.last] : chunk.out.size();
+                    writeOutput(string_view(chunk.out.data() + first, last - first));
+                    pos = run.stop;
+                    if (run.invalid)
                     {
-                        if (inst1.imm_to_reg_mem.s == 0)
-                        {
-                            return 6;
-                        }
-                        else
-                        {
-                            return 5;
-                        }
+                        flushOutput();
+                        cout << "Invalid Optag" << endl;
+                        return 1;
                     }
-                    else
+                    if (run.truncated)
                     {
-                        return 6;
+                        flushOutput();
+                        cout << "Truncated instruction at offset " << pos << endl;
+                        return 1;
                     }
-                    break;
-                case Byte:
-                    return 5;
-                    break;
+                    continue;
                 }
-                break;
-            }
-            break;
-        case 3:
-            switch (inst1.w)
-            {
-            case Word:
-                if (sMnemonic)
+
+                instruction command(unknown);
+                decodeAt(image, pos, command);
+                if (command.op_tag == unknown)
                 {
-                    if (inst1.imm_to_reg_mem.s == 0)
-                    {
-                        return 4;
-                    }
-                    else
-                    {
-                        return 3;
-                    }
+                    flushOutput();
+                    cout << "Invalid Optag" << endl;
+                    return 1;
                 }
-                else
+                if (pos + command.size > image.size)
                 {
-                    return 4;
+                    flushOutput();
+                    cout << "Truncated instruction at offset " << pos << endl;
+                    return 1;
                 }
-                break;
-            case Byte:
-                return 3;
-                break;
+                printCommand(command);
+                pos += command.size;
             }
-            break;
-        case 1:
-            switch (inst1.w)
+        }
+    }
+    flushOutput();
+    return 0;
+}
+
+void decodeChunk(const InputImage &image, DisasmChunk &chunk)
+{
+    char line[maxLineLength];
+    chunk.starts.clear();
+    chunk.text.clear();
+    chunk.out.clear();
+    chunk.runs.clear();
+
+    size_t pos = chunk.begin;
+    while (pos < chunk.end)
+    {
+        instruction command(unknown);
+        decodeAt(image, pos, command);
+        if (command.op_tag == unknown)
+        {
+            chunk.runs.push_back({chunk.starts.size(), pos, true, false});
+            pos++;
+            continue;
+        }
+        if (pos + command.size > image.size)
+        {
+            // Only the last instruction of the input can run past it, nothing follows to decode
+            chunk.runs.push_back({chunk.starts.size(), pos, false, true});
+            return;
+        }
+
+        chunk.starts.push_back(pos);
+        chunk.text.push_back(chunk.out.size());
+        size_t length = formatCommand(command, line);
+        line[length++] = '\n';
+        chunk.out.insert(chunk.out.end(), line, line + length);
+        pos += command.size;
+    }
+    chunk.runs.push_back({chunk.starts.size(), pos, false, false});
+}
+
+void decodeAt(const InputImage &image, size_t pos, instruction &inst1)
+{
+    // Instructions running off the end of the input are decoded from zero bytes to find their size,
+    // the caller reports them as truncated
+    if (pos + maxInstructionSize <= image.size)
+    {
+        decodeInstruction(image.data + pos, inst1);
+        return;
+    }
+
+    char window[maxInstructionSize] = {};
+    memcpy(window, image.data + pos, image.size - pos);
+    decodeInstruction(window, inst1);
+}
+
+int runBatch(const vector<string> &inputs, const string &outDir, Engine engine, int threads, bool quiet, const RunLimits &limits)
+{
+    // Expand directories into the files they hold, in name order
+    vector<BatchJob> jobs;
+    for (const string &input : inputs)
+    {
+        error_code error;
+        if (filesystem::is_directory(input, error))
+        {
+            vector<string> files;
+            for (const auto &entry : filesystem::directory_iterator(input, error))
             {
-            case Word:
-                if (sMnemonic)
-                {
-                    if (inst1.imm_to_reg_mem.s == 0)
-                    {
-                        return 5;
-                    }
-                    else
-                    {
-                        return 4;
-                    }
-                }
-                else
+                if (entry.is_regular_file(error))
                 {
-                    return 5;
+                    files.push_back(entry.path().string());
                 }
-                break;
-            case Byte:
-                return 4;
-                break;
             }
-            break;
-        case 2:
-            switch (inst1.w)
+            sort(files.begin(), files.end());
+            for (const string &file : files)
             {
-            case Word:
-                if (sMnemonic)
-                {
-                    if (inst1.imm_to_reg_mem.s == 0)
-                    {
-                        return 6;
-                    }
-                    else
-                    {
-                        return 5;
-                    }
-                }
-                else
-                {
-                    return 6;
-                }
-                break;
-            case Byte:
-                return 5;
-                break;
+                jobs.push_back({file, "", 0, ""});
             }
-            break;
         }
-        break;
-    case immediate_to_register:
-    case memory_to_acc_or_vv:
-        switch (inst1.w)
+        else
+        {
+            jobs.push_back({input, "", 0, ""});
+        }
+    }
+
+    // Output files are named after the input, numbered when that name is already taken, including
+    // by an input that is itself called name_N
+    error_code error;
+    filesystem::create_directories(outDir, error);
+    vector<string> seen;
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        string base = filesystem::path(jobs[k].path).filename().string();
+        string name = base;
+        for (int n = 1; find(seen.begin(), seen.end(), name) != seen.end(); n++)
+        {
+            name = base + "_" + to_string(n);
+        }
+        seen.push_back(name);
+        jobs[k].name = (filesystem::path(outDir) / name).string();
+    }
+
+    // Deal the jobs out round robin, idle workers steal from the others
+    threads = max(1, min(threads, (int)jobs.size()));
+    vector<WorkQueue> queues(threads);
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        queues[k % threads].jobs.push_back(k);
+    }
+
+    threadedHandlerTable();
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            size_t job;
+            while (takeJob(queues, t, job))
+            {
+                runBatchJob(jobs[job], engine, quiet, limits);
+            }
+        });
+    }
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    // One summary line per input, in the order given
+    int failures = 0;
+    for (const BatchJob &job : jobs)
+    {
+        cout << job.path << ": ";
+        if (job.error.empty())
+        {
+            cout << job.executed << " instructions" << '\n';
+        }
+        else
+        {
+            cout << job.error << '\n';
+            failures++;
+        }
+    }
+    cout << jobs.size() << " files, " << failures << " failed" << endl;
+    return (failures == 0) ? 0 : 1;
+}
+
+bool takeJob(vector<WorkQueue> &queues, int self, size_t &job)
+{
+    // Newest job from our own queue first, otherwise the oldest job of another worker
+    {
+        lock_guard<mutex> guard(queues[self].lock);
+        if (!queues[self].jobs.empty())
+        {
+            job = queues[self].jobs.back();
+            queues[self].jobs.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++)
+    {
+        WorkQueue &victim = queues[(self + k) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void runBatchJob(BatchJob &job, Engine engine, bool quiet, const RunLimits &limits)
+{
+    InputImage image;
+    if (!openInput(job.path, image))
+    {
+        job.error = "Error opening file";
+        return;
+    }
+
+    // Instruction trace to <name>.out unless quiet, final registers and flags to <name>.state
+    ofstream trace;
+    if (!quiet)
+    {
+        trace.open(job.name + ".out", ios::out | ios::binary);
+    }
+    ofstream state(job.name + ".state", ios::out | ios::binary);
+    if ((!quiet && !trace) || !state)
+    {
+        job.error = "Error opening output";
+        closeInput(image);
+        return;
+    }
+
+    CPU registers;
+    Flags &flag = registers.flag;
+    Memory memory;
+    int codeSize = min(image.size, (size_t)65536);
+    loadProgram(memory, image.data, codeSize);
+
+    RunLimits jobLimits = limits;
+    outputStream = &trace;
+    try
+    {
+        if (quiet)
+        {
+            job.executed = runQuiet(engine, registers, memory, flag, codeSize, jobLimits);
+            job.error = jobLimits.stopped;
+        }
+        else
+        {
+            job.executed = runEngine(engine, registers, memory, flag, codeSize, true);
+        }
+    }
+    catch (const exception &failure)
+    {
+        flushOutput();
+        trace << failure.what() << endl;
+        job.error = failure.what();
+    }
+    flushOutput();
+    outputStream = &cout;
+
+    if (!jobLimits.stopped.empty())
+    {
+        state << jobLimits.stopped << endl;
+    }
+    printFinalState(state, registers, flag);
+    closeInput(image);
+}
+
+void printFinalState(ostream &out, CPU &cpu, Flags &flag)
+{
+    // Print register states
+    out << endl
+        << "Final Registers:" << endl;
+    for (int k = 0; k < 13; k++)
+    {
+        out << regList[k] << ": " << cpu.regSlots[k] << endl; // register ID and value
+    }
+
+    // Print flag states
+    u16 flagValue = readFlags(flag);
+    out << endl
+        << "Final Flags: " << endl;
+    for (int l = 0; l < 9; l++)
+    {
+        out << flagsList[flagsListMask[l]] << ": " << ((flagValue >> flagsListMask[l]) & 1) << endl;
+    }
+}
+
+void closeInput(InputImage &image)
+{
+#if defined(__unix__)
+    if (image.mapping != nullptr)
+    {
+        munmap(image.mapping, image.size);
+    }
+#endif
+    image.mapping = nullptr;
+    image.data = nullptr;
+    image.size = 0;
+    image.storage.clear();
+}
+
+const char *decodeInstruction(const char *cursor, instruction &inst1)
+{
+    const char *start = cursor;
+
+    // Segment override prefix 001 sr 110, sr counts es, cs, ss, ds like the register slots from 8
+    inst1.segmentPrefix = -1;
+    if ((*cursor & 0b11100111) == 0b00100110)
+    {
+        inst1.segmentPrefix = 8 + ((*cursor >> 3) & twoBitConv);
+        cursor++;
+    }
+
+    int opCode = *cursor++;
+    const OpcodeInfo &info = opcodeTable.entries[opCode & lowBitsMask];
+
+    inst1.op_tag = info.op_tag;
+    inst1.mnemonic = info.mnemonic;
+
+    int wide = (info.wBit >= 0) ? ((opCode >> info.wBit) & singBitConv) : 1;
+    int dValue = (info.dBit >= 0) ? ((opCode >> info.dBit) & singBitConv) : 0;
+    inst1.w = wide ? Word : Byte;
+    const RM *regRM = wide ? regWordRM : regByteRM;
+
+    // ModRM byte and displacement, all fields come from one table lookup
+    MOD mode = register_mode;
+    int regField = 0;
+    RM rmConv = RM::not_set;
+    RM regConv = RM::not_set;
+    int disp = 0;
+    inst1.modRM = 0b00000110;
+    inst1.segment = 11;
+    if (info.hasModRM)
+    {
+        inst1.modRM = *cursor++ & lowBitsMask;
+        const ModRMInfo &entry = modRMTable.entries[inst1.modRM];
+        mode = entry.mode;
+        regField = entry.reg;
+        rmConv = entry.rmOperand[wide];
+        regConv = entry.regOperand[wide];
+        inst1.segment = entry.segment;
+
+        if (info.regSelectsMnemonic)
+        {
+            inst1.mnemonic = immGroupMnemonic[regField];
+            if (!immGroupSupported[regField])
+            {
+                inst1.op_tag = unknown;
+            }
+        }
+
+        if (entry.dispSize == 1)
+        {
+            disp = *cursor++;
+        }
+        else if (entry.dispSize == 2)
+        {
+            disp = ((cursor[1] << 8) & highBitsMask) + (cursor[0] & lowBitsMask);
+            cursor += 2;
+        }
+    }
+    if (inst1.segmentPrefix >= 0)
+    {
+        inst1.segment = inst1.segmentPrefix;
+    }
+
+    // Operands and immediate data
+    switch (inst1.op_tag)
+    {
+    case register_mem_to_from_register:
+        inst1.reg_mem_to_from_reg.rm = rmConv;
+        inst1.reg_mem_to_from_reg.reg = regConv;
+        inst1.reg_mem_to_from_reg.mod = mode;
+        inst1.reg_mem_to_from_reg.disp = disp;
+        if (dValue)
+        {
+            inst1.reg_mem_to_from_reg.d = register_is_destination;
+            inst1.reg_mem_to_from_reg.source = getRegOffset(rmConv);
+            inst1.reg_mem_to_from_reg.dest = getRegOffset(regConv);
+        }
+        else
+        {
+            inst1.reg_mem_to_from_reg.d = register_is_source;
+            inst1.reg_mem_to_from_reg.source = getRegOffset(regConv);
+            inst1.reg_mem_to_from_reg.dest = getRegOffset(rmConv);
+        }
+        break;
+    case immediate_to_register_mem:
+        inst1.imm_to_reg_mem.rm = rmConv;
+        inst1.imm_to_reg_mem.mod = mode;
+        inst1.imm_to_reg_mem.disp = disp;
+        inst1.imm_to_reg_mem.s = (wide && (info.sBit >= 0)) ? ((opCode >> info.sBit) & singBitConv) : 0;
+        if (wide && (inst1.imm_to_reg_mem.s == 0))
+        {
+            inst1.imm_to_reg_mem.data = static_cast<int16_t>(((cursor[1] << 8) & highBitsMask) + (cursor[0] & lowBitsMask));
+            cursor += 2;
+        }
+        else
+        {
+            inst1.imm_to_reg_mem.data = static_cast<int16_t>(cursor[0]);
+            cursor += 1;
+        }
+        inst1.imm_to_reg_mem.dest = getRegOffset(rmConv);
+        break;
+    case register_mem_to_from_seg_register:
+        inst1.reg_mem_to_from_seg_reg.rm = rmConv;
+        inst1.reg_mem_to_from_seg_reg.mod = mode;
+        inst1.reg_mem_to_from_seg_reg.disp = disp;
+        inst1.reg_mem_to_from_seg_reg.d = dValue ? segment_register_is_destination : segment_register_is_source;
+        inst1.reg_mem_to_from_seg_reg.sr = segRegSR[regField & twoBitConv];
+        inst1.reg_mem_to_from_seg_reg.operandOne = getRegOffset(rmConv);
+        inst1.reg_mem_to_from_seg_reg.operandTwo = inst1.reg_mem_to_from_seg_reg.sr;
+        break;
+    case immediate_to_register:
+        // mov encodes the register in the opcode, add/sub/cmp always target the accumulator
+        inst1.imm_to_reg.reg = (inst1.mnemonic == mov) ? regRM[opCode & threeBitconv] : regRM[0];
+        if (wide)
+        {
+            inst1.imm_to_reg.data = static_cast<int16_t>(((cursor[1] << 8) & highBitsMask) + (cursor[0] & lowBitsMask));
+            cursor += 2;
+        }
+        else
+        {
+            inst1.imm_to_reg.data = static_cast<int16_t>(cursor[0]);
+            cursor += 1;
+        }
+        inst1.imm_to_reg.source = inst1.imm_to_reg.data;
+        inst1.imm_to_reg.dest = getRegOffset(inst1.imm_to_reg.reg);
+        break;
+    case memory_to_acc_or_vv:
+        // The address is always 16 bits, W only selects al or ax
+        inst1.mem_to_acc.disp = ((cursor[1] << 8) & highBitsMask) + (cursor[0] & lowBitsMask);
+        cursor += 2;
+        inst1.mem_to_acc.d = dValue ? accumulator_is_source : accumulator_is_destination;
+        inst1.mem_to_acc.operandOne = RM::ax;
+        break;
+    case conditional_jump:
+        inst1.cond_jmp.data = static_cast<int16_t>(cursor[0]);
+        inst1.cond_jmp.condition = opCode & 0x0F;
+        cursor += 1;
+        break;
+    default:
+        break;
+    }
+
+    inst1.size = cursor - start;
+    inst1.handler = selectHandler(inst1);
+    return cursor;
+}
+
+void loadProgram(Memory &memory, const char *buffer, int codeSize)
+{
+    if (codeSize > 0)
+    {
+        memcpy(memory.memSlots.data(), buffer, codeSize);
+    }
+    memory.decodeCache.resize(codeSize);
+}
+
+const instruction &fetchInstruction(Memory &memory, int ip)
+{
+    instruction &entry = memory.decodeCache[ip];
+    if (entry.size == 0)
+    {
+        decodeInstruction(reinterpret_cast<const char *>(memory.memSlots.data()) + ip, entry);
+    }
+    return entry;
+}
+
+// Offsets wrap within their 64 KB segment, physical addresses at 1 MB
+i8 readMemory(Memory &memory, u32 segmentBase, int offset)
+{
+    return memory.memSlots[(segmentBase + (offset & sixteenBitMask)) & memoryMask];
+}
+
+void writeMemory(Memory &memory, u32 segmentBase, int offset, i8 value)
+{
+    int address = (segmentBase + (offset & sixteenBitMask)) & memoryMask;
+    memory.memSlots[address] = value;
+
+    // A store over the program drops every cached instruction that could include this byte
+    if (address < (int)memory.decodeCache.size())
+    {
+        memory.codeModified = true;
+        memory.modifiedFirst = (memory.modifiedLast < 0) ? address : min(memory.modifiedFirst, address);
+        memory.modifiedLast = max(memory.modifiedLast, address);
+        for (int k = max(0, address - maxInstructionSize + 1); k <= address; k++)
+        {
+            memory.decodeCache[k].size = 0;
+        }
+    }
+}
+
+// Segment registers are only written here, so their base addresses never go stale
+void setSegment(CPU &cpu, int slot, i16 value)
+{
+    cpu.regSlots[slot] = value;
+    cpu.segmentBase[slot - 8] = (u16)value << 4;
+}
+
+void printCommand(const instruction &inst1)
+{
+    if (output.used + maxLineLength > outputBufferSize)
+    {
+        flushOutput();
+    }
+    output.used += formatCommand(inst1, output.data + output.used);
+    output.data[output.used++] = '\n';
+}
+
+size_t formatCommand(const instruction &inst1, char *line)
+{
+    char *cursor = appendText(line, enumMnemonicToString(inst1.mnemonic));
+    switch (inst1.op_tag)
+    {
+    case register_mem_to_from_register:
+    {
+        const Register_mem_to_from_register &operands = inst1.reg_mem_to_from_reg;
+        int disp = listedDisp(inst1, operands.disp);
+        bool showDisp = (modRMTable.entries[inst1.modRM].dispSize > 0) && (disp != 0);
+        int segment = (operands.mod == register_mode) ? -1 : inst1.segmentPrefix;
+        if (operands.d == register_is_source)
+        {
+            cursor = appendText(cursor, " ");
+            cursor = appendOperand(cursor, operands.rm, disp, showDisp, segment);
+            cursor = appendText(cursor, ", ");
+            cursor = appendText(cursor, enumRMToString(operands.reg, disp));
+        }
+        else if (operands.d == register_is_destination)
+        {
+            cursor = appendText(cursor, " ");
+            cursor = appendText(cursor, enumRMToString(operands.reg, disp));
+            cursor = appendText(cursor, ", ");
+            cursor = appendOperand(cursor, operands.rm, disp, showDisp, segment);
+        }
+        else
+        {
+            cursor = appendText(cursor, ", ");
+        }
+        break;
+    }
+    case immediate_to_register:
+        cursor = appendText(cursor, " ");
+        cursor = appendText(cursor, enumRMToString(inst1.imm_to_reg.reg, 0));
+        cursor = appendText(cursor, ", ");
+        cursor = appendInt(cursor, inst1.imm_to_reg.data);
+        break;
+    case immediate_to_register_mem:
+        cursor = appendText(cursor, " ");
+    {
+        int disp = listedDisp(inst1, inst1.imm_to_reg_mem.disp);
+        cursor = appendOperand(cursor, inst1.imm_to_reg_mem.rm, disp, (modRMTable.entries[inst1.modRM].dispSize > 0) && (disp != 0),
+                               (inst1.imm_to_reg_mem.mod == register_mode) ? -1 : inst1.segmentPrefix);
+        cursor = appendText(cursor, ", ");
+        cursor = appendInt(cursor, inst1.imm_to_reg_mem.data);
+        break;
+    }
+    case memory_to_acc_or_vv:
+        if (inst1.mem_to_acc.d == accumulator_is_destination)
+        {
+            cursor = appendText(cursor, " ax, ");
+            cursor = appendSegment(cursor, inst1.segmentPrefix);
+            cursor = appendInt(cursor, (u16)inst1.mem_to_acc.disp);
+        }
+        else if (inst1.mem_to_acc.d == accumulator_is_source)
+        {
+            cursor = appendText(cursor, " ");
+            cursor = appendSegment(cursor, inst1.segmentPrefix);
+            cursor = appendInt(cursor, (u16)inst1.mem_to_acc.disp);
+            cursor = appendText(cursor, ", ax");
+        }
+        else
+        {
+            cursor = appendText(cursor, ", ");
+        }
+        break;
+    case register_mem_to_from_seg_register:
+    {
+        const Register_mem_to_from_seg_register &operands = inst1.reg_mem_to_from_seg_reg;
+        int disp = listedDisp(inst1, operands.disp);
+        bool showDisp = (modRMTable.entries[inst1.modRM].dispSize > 0) && (disp != 0);
+        int segment = (operands.mod == register_mode) ? -1 : inst1.segmentPrefix;
+        if (operands.d == segment_register_is_destination)
+        {
+            cursor = appendText(cursor, " ");
+            cursor = appendText(cursor, enumSRToString(operands.sr));
+            cursor = appendText(cursor, ", ");
+            cursor = appendOperand(cursor, operands.rm, disp, showDisp, segment);
+        }
+        else if (operands.d == segment_register_is_source)
+        {
+            cursor = appendText(cursor, " ");
+            cursor = appendOperand(cursor, operands.rm, disp, showDisp, segment);
+            cursor = appendText(cursor, ", ");
+            cursor = appendText(cursor, enumSRToString(operands.sr));
+        }
+        else
+        {
+            cursor = appendText(cursor, ", ");
+        }
+        break;
+    }
+    case conditional_jump:
+        cursor = appendText(cursor, ", ");
+        cursor = appendInt(cursor, inst1.cond_jmp.data);
+        break;
+    default:
+        cursor = appendText(cursor, ", ");
+        break;
+    }
+    return cursor - line;
+}
+
+// Displacements are stored as i16; 16-bit ones are listed unsigned, 8-bit ones keep their sign
+int listedDisp(const instruction &inst1, i16 disp)
+{
+    return (modRMTable.entries[inst1.modRM].dispSize == 2) ? (int)(u16)disp : (int)disp;
+}
+
+// Register or effective address, followed by the displacement when it's shown
+char *appendOperand(char *cursor, RM rm, int disp, bool showDisp, int segment)
+{
+    cursor = appendSegment(cursor, segment);
+    cursor = appendText(cursor, enumRMToString(rm, disp));
+    if (showDisp)
+    {
+        cursor = appendText(cursor, " ");
+        cursor = appendInt(cursor, disp);
+    }
+    return cursor;
+}
+
+// "es:" ahead of a memory operand with a segment override, nothing for -1
+char *appendSegment(char *cursor, int segment)
+{
+    if (segment >= 0)
+    {
+        cursor = appendText(cursor, regList[segment]);
+        *cursor++ = ':';
+    }
+    return cursor;
+}
+
+char *appendText(char *cursor, string_view text)
+{
+    memcpy(cursor, text.data(), text.size());
+    return cursor + text.size();
+}
+
+char *appendInt(char *cursor, long long value)
+{
+    char digits[21];
+    int count = 0;
+    unsigned long long magnitude = (value < 0) ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[count++] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (value < 0)
+    {
+        *cursor++ = '-';
+    }
+    while (count > 0)
+    {
+        *cursor++ = digits[--count];
+    }
+    return cursor;
+}
+
+void writeOutput(string_view text)
+{
+    if (output.used + text.size() > outputBufferSize)
+    {
+        flushOutput();
+    }
+    if (text.size() > outputBufferSize)
+    {
+        outputStream->write(text.data(), text.size());
+        return;
+    }
+    output.used = appendText(output.data + output.used, text) - output.data;
+}
+
+void flushOutput()
+{
+    outputStream->write(output.data, output.used);
+    outputStream->flush();
+    output.used = 0;
+}
+
+long long runEngine(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace)
+{
+    if (engine == Engine::interpreter)
+    {
+        return runInterpreter(cpu, memory, flag, codeEnd, trace);
+    }
+    return runBlocks(engine, cpu, memory, flag, codeEnd, trace, nullptr);
+}
+
+long long runInterpreter(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace)
+{
+    long long executed = 0;
+    while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+    {
+        const instruction &command = fetchInstruction(memory, cpu.regSlots[12] & sixteenBitMask);
+        if (command.op_tag == unknown)
+        {
+            throw runtime_error("Invalid Optag");
+        }
+
+        // Print instruction
+        if (trace)
+        {
+            printCommand(command);
+        }
+
+        cpu.regSlots[12] += command.size;
+
+        // Perform operation
+        executeCommand(command, cpu, memory, flag);
+        executed++;
+    }
+    return executed;
+}
+
+long long runQuiet(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, RunLimits &limits)
+{
+    limits.start = chrono::steady_clock::now();
+    limits.nextCheck = limitCheckInterval;
+    if (engine != Engine::interpreter)
+    {
+        return runBlocks(engine, cpu, memory, flag, codeEnd, false, &limits);
+    }
+
+    // Same loop as runInterpreter without the print, run in slices that end at the next limit check
+    long long executed = 0;
+    while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+    {
+        long long stopAt = limits.nextCheck;
+        if (limits.maxInstructions > 0)
+        {
+            stopAt = min(stopAt, limits.maxInstructions);
+        }
+
+        while (((cpu.regSlots[12] & sixteenBitMask) < codeEnd) && (executed < stopAt))
+        {
+            const instruction &command = fetchInstruction(memory, cpu.regSlots[12] & sixteenBitMask);
+            if (command.op_tag == unknown)
+            {
+                throw runtime_error("Invalid Optag");
+            }
+
+            cpu.regSlots[12] += command.size;
+            executeCommand(command, cpu, memory, flag);
+            executed++;
+        }
+
+        if (((cpu.regSlots[12] & sixteenBitMask) < codeEnd) && limitReached(limits, executed))
+        {
+            break;
+        }
+    }
+    return executed;
+}
+
+bool limitReached(RunLimits &limits, long long executed)
+{
+    if ((limits.maxInstructions > 0) && (executed >= limits.maxInstructions))
+    {
+        limits.stopped = "Instruction budget of " + to_string(limits.maxInstructions) + " reached";
+        return true;
+    }
+
+    // The clock is only read every limitCheckInterval instructions
+    if (executed >= limits.nextCheck)
+    {
+        limits.nextCheck = executed + limitCheckInterval;
+        if ((limits.timeoutSeconds > 0) &&
+            (chrono::duration<double>(chrono::steady_clock::now() - limits.start).count() >= limits.timeoutSeconds))
+        {
+            limits.stopped = "Timed out after " + to_string(executed) + " instructions";
+            return true;
+        }
+    }
+    return false;
+}
+
+long long runTimed(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, long long &clocks)
+{
+    // Same loop as runInterpreter, with each instruction's 8086 clocks added up as it runs
+    long long executed = 0;
+    while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+    {
+        const instruction &command = fetchInstruction(memory, cpu.regSlots[12] & sixteenBitMask);
+        if (command.op_tag == unknown)
+        {
+            throw runtime_error("Invalid Optag");
+        }
+
+        // Addresses are taken before the instruction can change the registers they come from
+        ClockEstimate estimate = estimateClocks(command, cpu);
+        cpu.regSlots[12] += command.size;
+
+        // Jumps are decided here rather than from where ip ends up, a taken jump of 0 lands on the next
+        // instruction all the same
+        if (command.op_tag == conditional_jump)
+        {
+            if (branchTaken(command.mnemonic, command.cond_jmp.condition, cpu, flag))
+            {
+                cpu.regSlots[12] += command.cond_jmp.data;
+                estimate.base += takenClocks(command.mnemonic);
+            }
+        }
+        else
+        {
+            executeCommand(command, cpu, memory, flag);
+        }
+        executed++;
+        clocks += estimate.base + estimate.ea + estimate.penalty;
+
+        if (trace)
+        {
+            printTimedCommand(command, estimate, clocks);
+        }
+    }
+    return executed;
+}
+
+ClockEstimate estimateClocks(const instruction &inst1, const CPU &cpu)
+{
+    RM memoryOperand;
+    int transfers;
+    ClockEstimate estimate = encodingClocks(inst1, memoryOperand, transfers);
+    estimate.penalty = addressPenalty(inst1, transfers, cpu);
+    return estimate;
+}
+
+ClockEstimate encodingClocks(const instruction &inst1, RM &memoryOperand, int &transfers)
+{
+    // Clocks from the 8086 manual's instruction timing tables, jumps start out not taken.
+    // Everything but the odd address penalty is fixed by the encoding
+    ClockEstimate estimate;
+    bool arithmetic = (inst1.mnemonic == add) || (inst1.mnemonic == sub);
+    bool wide = (inst1.w == Word);
+    memoryOperand = RM::not_set;
+    transfers = 0;
+    switch (inst1.op_tag)
+    {
+    case register_mem_to_from_register:
+        if (inst1.reg_mem_to_from_reg.mod == register_mode)
+        {
+            estimate.base = (inst1.mnemonic == mov) ? 2 : 3;
+        }
+        else if (inst1.reg_mem_to_from_reg.d == register_is_source) // memory is the destination
+        {
+            memoryOperand = inst1.reg_mem_to_from_reg.rm;
+            estimate.base = arithmetic ? 16 : 9;
+            transfers = arithmetic ? 2 : 1;
+        }
+        else
+        {
+            memoryOperand = inst1.reg_mem_to_from_reg.rm;
+            estimate.base = (inst1.mnemonic == mov) ? 8 : 9;
+            transfers = 1;
+        }
+        break;
+    case immediate_to_register_mem:
+        if (inst1.imm_to_reg_mem.mod == register_mode)
+        {
+            estimate.base = 4;
+        }
+        else
+        {
+            memoryOperand = inst1.imm_to_reg_mem.rm;
+            estimate.base = arithmetic ? 17 : 10;
+            transfers = arithmetic ? 2 : 1;
+        }
+        break;
+    case immediate_to_register:
+        estimate.base = 4;
+        break;
+    case memory_to_acc_or_vv:
+        estimate.base = 10;
+        transfers = 1;
+        break;
+    case register_mem_to_from_seg_register:
+        wide = true;
+        if (inst1.reg_mem_to_from_seg_reg.mod == register_mode)
+        {
+            estimate.base = 2;
+        }
+        else
+        {
+            memoryOperand = inst1.reg_mem_to_from_seg_reg.rm;
+            estimate.base = (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_destination) ? 8 : 9;
+            transfers = 1;
+        }
+        break;
+    case conditional_jump:
+        switch (inst1.mnemonic)
+        {
+        case jcxz:
+        case loopz:
+            estimate.base = 6;
+            break;
+        case loop:
+        case loopnz:
+            estimate.base = 5;
+            break;
+        default:
+            estimate.base = 4;
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (memoryOperand != RM::not_set)
+    {
+        estimate.ea = eaClocks(memoryOperand);
+    }
+
+    // A segment override prefix adds 2 clocks to the address calculation
+    if (inst1.segmentPrefix >= 0)
+    {
+        estimate.ea += 2;
+    }
+
+    // Only word transfers can be penalized
+    if (!wide)
+    {
+        transfers = 0;
+    }
+    return estimate;
+}
+
+int addressPenalty(const instruction &inst1, int transfers, const CPU &cpu)
+{
+    // Words at odd addresses take a second bus cycle per transfer
+    if (transfers == 0)
+    {
+        return 0;
+    }
+    int address = getCPUMem(inst1, cpu);
+    return ((address & 1) != 0) ? 4 * transfers : 0;
+}
+
+int eaClocks(RM rm)
+{
+    switch (rm)
+    {
+    case RM::direct_address:
+        return 6;
+    case RM::si:
+    case RM::di:
+    case RM::bx:
+        return 5;
+    case RM::si_plus8:
+    case RM::di_plus8:
+    case RM::bp_plus8:
+    case RM::bx_plus8:
+    case RM::si_plus16:
+    case RM::di_plus16:
+    case RM::bp_plus16:
+    case RM::bx_plus16:
+        return 9;
+    case RM::bp_plus_di:
+    case RM::bx_plus_si:
+        return 7;
+    case RM::bp_plus_si:
+    case RM::bx_plus_di:
+        return 8;
+    case RM::bp_plus_di_plus8:
+    case RM::bx_plus_si_plus8:
+    case RM::bp_plus_di_plus16:
+    case RM::bx_plus_si_plus16:
+        return 11;
+    case RM::bp_plus_si_plus8:
+    case RM::bx_plus_di_plus8:
+    case RM::bp_plus_si_plus16:
+    case RM::bx_plus_di_plus16:
+        return 12;
+    default: // Register operand
+        return 0;
+    }
+}
+
+int takenClocks(Mnemonic mnemonic)
+{
+    // Extra clocks when a jump or loop is taken, on top of the not taken count
+    switch (mnemonic)
+    {
+    case loopnz:
+        return 14;
+    default:
+        return 12;
+    }
+}
+
+void printTimedCommand(const instruction &inst1, const ClockEstimate &estimate, long long total)
+{
+    if (output.used + maxLineLength + maxClocksLength > outputBufferSize)
+    {
+        flushOutput();
+    }
+
+    // e.g. "mov ax, bx + si ; Clocks: +19 = 42 (8 + 7ea + 4p)"
+    char *start = output.data + output.used;
+    char *cursor = start + formatCommand(inst1, start);
+    cursor = appendText(cursor, " ; Clocks: +");
+    cursor = appendInt(cursor, estimate.base + estimate.ea + estimate.penalty);
+    cursor = appendText(cursor, " = ");
+    cursor = appendInt(cursor, total);
+    if ((estimate.ea > 0) || (estimate.penalty > 0))
+    {
+        cursor = appendText(cursor, " (");
+        cursor = appendInt(cursor, estimate.base);
+        if (estimate.ea > 0)
+        {
+            cursor = appendText(cursor, " + ");
+            cursor = appendInt(cursor, estimate.ea);
+            cursor = appendText(cursor, "ea");
+        }
+        if (estimate.penalty > 0)
+        {
+            cursor = appendText(cursor, " + ");
+            cursor = appendInt(cursor, estimate.penalty);
+            cursor = appendText(cursor, "p");
+        }
+        cursor = appendText(cursor, ")");
+    }
+    *cursor++ = '\n';
+    output.used = cursor - output.data;
+}
+
+long long runProfiled(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, Profile &profile)
+{
+    profile.counters.assign(codeEnd, AddressCounter());
+    profile.loops.assign(codeEnd, LoopCounter());
+
+    // A block starts at the entry point and after every jump, taken or not
+    long long executed = 0;
+    int block = -1;
+    while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+    {
+        int ip = cpu.regSlots[12] & sixteenBitMask;
+        const instruction &command = fetchInstruction(memory, ip);
+        if (command.op_tag == unknown)
+        {
+            throw runtime_error("Invalid Optag");
+        }
+
+        if (trace)
+        {
+            printCommand(command);
+        }
+
+        if (block < 0)
+        {
+            block = ip;
+            profile.counters[block].blockEntries++;
+        }
+        AddressCounter &counter = profile.counters[ip];
+        if (!counter.estimated)
+        {
+            counter.estimate = encodingClocks(command, counter.memoryOperand, counter.transfers);
+            counter.estimated = true;
+        }
+        ClockEstimate estimate = counter.estimate;
+        estimate.penalty = addressPenalty(command, counter.transfers, cpu);
+        cpu.regSlots[12] += command.size;
+
+        // As in runTimed, a jump is taken when its condition holds, whatever its displacement
+        bool taken = false;
+        if (command.op_tag == conditional_jump)
+        {
+            taken = branchTaken(command.mnemonic, command.cond_jmp.condition, cpu, flag);
+            if (taken)
+            {
+                cpu.regSlots[12] += command.cond_jmp.data;
+            }
+        }
+        else
+        {
+            executeCommand(command, cpu, memory, flag);
+        }
+        executed++;
+        if (memory.codeModified)
+        {
+            // The program changed its own code, estimates are redone for the instructions that could
+            // include the bytes stored to
+            int first = max(0, memory.modifiedFirst - maxInstructionSize + 1);
+            int last = min(memory.modifiedLast, codeEnd - 1);
+            for (int k = first; k <= last; k++)
+            {
+                profile.counters[k].estimated = false;
+            }
+            memory.codeModified = false;
+            memory.modifiedLast = -1;
+        }
+        if (command.op_tag == conditional_jump)
+        {
+            if (taken)
+            {
+                estimate.base += takenClocks(command.mnemonic);
+            }
+            if ((command.mnemonic == loop) || (command.mnemonic == loopz) || (command.mnemonic == loopnz) ||
+                ((command.mnemonic == jne) && (command.cond_jmp.data < 0)))
+            {
+                countLoop(profile.loops[ip], taken);
+            }
+        }
+
+        int clocks = estimate.base + estimate.ea + estimate.penalty;
+        counter.hits++;
+        counter.clocks += clocks;
+        profile.counters[block].blockClocks += clocks;
+        profile.totalClocks += clocks;
+        if (command.op_tag == conditional_jump)
+        {
+            block = -1;
+        }
+    }
+    return executed;
+}
+
+void countLoop(LoopCounter &counter, bool taken)
+{
+    // Each fall through ends one run of the loop, its trip count is the branches it took plus this one
+    counter.iterations++;
+    counter.current++;
+    if (!taken)
+    {
+        counter.exits++;
+        counter.longest = max(counter.longest, counter.current);
+        counter.current = 0;
+    }
+}
+
+void printProfile(ostream &out, Memory &memory, const Profile &profile, long long executed)
+{
+    int codeEnd = profile.counters.size();
+    double total = max(profile.totalClocks, 1ll);
+    out << endl
+        << "Profile: " << executed << " instructions, " << profile.totalClocks << " estimated clocks" << endl;
+
+    // Hottest addresses by estimated clocks
+    vector<int> order;
+    for (int ip = 0; ip < codeEnd; ip++)
+    {
+        if (profile.counters[ip].hits > 0)
+        {
+            order.push_back(ip);
+        }
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) { return profile.counters[a].clocks > profile.counters[b].clocks; });
+    out << endl
+        << "Hottest instructions:" << endl
+        << left << setw(10) << "address" << setw(14) << "count" << setw(16) << "clocks" << setw(10) << "share" << "instruction" << endl;
+    for (size_t k = 0; (k < order.size()) && (k < profileReportSize); k++)
+    {
+        int ip = order[k];
+        const instruction &entry = fetchInstruction(memory, ip);
+        char line[maxLineLength];
+        size_t length = formatCommand(entry, line);
+        out << left << setw(10) << ip << setw(14) << profile.counters[ip].hits << setw(16) << profile.counters[ip].clocks
+            << setw(10) << (to_string((int)(100 * profile.counters[ip].clocks / total)) + "%") << string_view(line, length) << endl;
+    }
+
+    // Hottest blocks, each running from its start to the next jump
+    order.clear();
+    for (int ip = 0; ip < codeEnd; ip++)
+    {
+        if (profile.counters[ip].blockEntries > 0)
+        {
+            order.push_back(ip);
+        }
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) { return profile.counters[a].blockClocks > profile.counters[b].blockClocks; });
+    out << endl
+        << "Hottest blocks:" << endl
+        << left << setw(16) << "addresses" << setw(14) << "entries" << setw(16) << "clocks" << "share" << endl;
+    for (size_t k = 0; (k < order.size()) && (k < profileReportSize); k++)
+    {
+        int start = order[k];
+        int last = start;
+        for (int ip = start; ip < codeEnd;)
+        {
+            const instruction &command = fetchInstruction(memory, ip);
+            if (command.op_tag == unknown)
+            {
+                break;
+            }
+            last = ip;
+            if (command.op_tag == conditional_jump)
+            {
+                break;
+            }
+            ip += command.size;
+        }
+        out << left << setw(16) << (to_string(start) + "-" + to_string(last)) << setw(14) << profile.counters[start].blockEntries
+            << setw(16) << profile.counters[start].blockClocks << (to_string((int)(100 * profile.counters[start].blockClocks / total)) + "%") << endl;
+    }
+
+    // Trip counts for loop, loopz, loopnz and backward jne
+    out << endl
+        << "Loops:" << endl
+        << left << setw(10) << "address" << setw(24) << "instruction" << setw(12) << "entries" << setw(14) << "iterations"
+        << setw(12) << "avg trips" << "max trips" << endl;
+    for (int ip = 0; ip < codeEnd; ip++)
+    {
+        const LoopCounter &counter = profile.loops[ip];
+        if (counter.iterations == 0)
+        {
+            continue;
+        }
+
+        // A loop still running when the program stopped counts as one more entry
+        long long entries = counter.exits + ((counter.current > 0) ? 1 : 0);
+        const instruction &entry = fetchInstruction(memory, ip);
+        char line[maxLineLength];
+        size_t length = formatCommand(entry, line);
+        out << left << setw(10) << ip << setw(24) << string_view(line, length) << setw(12) << entries
+            << setw(14) << counter.iterations << setw(12) << fixed << setprecision(2) << ((double)counter.iterations / entries)
+            << max(counter.longest, counter.current) << endl;
+    }
+}
+
+long long runTraced(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, TraceWriter &writer)
+{
+    // Same loop as runInterpreter, recording each instruction in the binary trace instead of printing it
+    writer.seen.assign(codeEnd, 0);
+    writeTrace(writer, traceMagic, sizeof(traceMagic));
+
+    long long executed = 0;
+    while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+    {
+        int ip = cpu.regSlots[12] & sixteenBitMask;
+        const instruction &command = fetchInstruction(memory, ip);
+        if (command.op_tag == unknown)
+        {
+            throw runtime_error("Invalid Optag");
+        }
+
+        // The bytes as they ran, for an address recorded for the first time. A store into this
+        // instruction drops its cache entry and must not show up in its own record
+        int size = command.size;
+        u8 bytes[maxInstructionSize];
+        if (writer.seen[ip] == 0)
+        {
+            for (int k = 0; k < size; k++)
+            {
+                bytes[k] = memory.memSlots[(ip + k) & sixteenBitMask];
+            }
+        }
+
+        cpu.regSlots[12] += size;
+        executeCommand(command, cpu, memory, flag);
+        executed++;
+
+        // Only add/sub/cmp leave the lazy flags pending, after anything else FLAGS is as last recorded
+        writeTraceRecord(writer, bytes, ip, size, cpu, flag.pending ? readFlags(flag) : writer.flags);
+        if (memory.codeModified)
+        {
+            // Bytes at any address may have changed, so the next run of each is recorded again
+            memory.codeModified = false;
+            writer.seen.assign(codeEnd, 0);
+        }
+    }
+    return executed;
+}
+
+void writeTraceRecord(TraceWriter &writer, const u8 *bytes, int ip, int size, const CPU &after, u16 flags)
+{
+    // Records are built in place, the buffer goes out in one write when it can't fit another
+    if (writer.used + traceRecordMax > writer.buffer.size())
+    {
+        flushTrace(writer);
+    }
+    u8 *record = writer.buffer.data() + writer.used;
+    u8 *cursor = record + 1;
+    u8 tag = 0;
+
+    if (ip != writer.expectedIp)
+    {
+        tag |= traceHasIp;
+        cursor = putVarint(cursor, zigzag(ip - writer.expectedIp));
+    }
+    writer.expectedIp = (ip + size) & sixteenBitMask;
+
+    // Raw bytes only the first time an address runs, the viewer remembers them after that
+    if (writer.seen[ip] == 0)
+    {
+        writer.seen[ip] = 1;
+        tag |= size;
+        memcpy(cursor, bytes, size);
+        cursor += size;
+    }
+
+    if (flags != writer.flags)
+    {
+        tag |= traceHasFlags;
+        cursor = putVarint(cursor, packTraceFlags(flags ^ writer.flags));
+        writer.flags = flags;
+    }
+
+    // One mask bit per register that changed since the previous record, ip excluded, then the
+    // changes in register order
+    int changed = changedRegisters(after.regSlots, writer.registers);
+    if ((changed & 0xFF) != 0)
+    {
+        tag |= traceHasRegisters;
+        *cursor++ = changed & 0xFF;
+    }
+    if ((changed >> 8) != 0)
+    {
+        tag |= traceHasSegments;
+        *cursor++ = changed >> 8;
+    }
+    for (int bits = changed; bits != 0; bits &= bits - 1)
+    {
+        int k = lowestSetBit(bits);
+        cursor = putVarint(cursor, zigzag(after.regSlots[k] - writer.registers[k]));
+        writer.registers[k] = after.regSlots[k];
+    }
+
+    record[0] = tag;
+    writer.used = cursor - writer.buffer.data();
+}
+
+void writeTrace(TraceWriter &writer, const void *data, size_t size)
+{
+    if (writer.used + size > writer.buffer.size())
+    {
+        flushTrace(writer);
+    }
+    memcpy(writer.buffer.data() + writer.used, data, size);
+    writer.used += size;
+}
+
+void flushTrace(TraceWriter &writer)
+{
+    writer.out->write(reinterpret_cast<const char *>(writer.buffer.data()), writer.used);
+    writer.used = 0;
+}
+
+int changedRegisters(const i16 *now, const i16 *previous)
+{
+#if defined(__SSE2__)
+    // ax..di in one compare, es..ds in the low half of a second one whose zeroed upper lanes always match
+    __m128i general = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(now)),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i *>(previous)));
+    __m128i segments = _mm_cmpeq_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(now + 8)),
+                                       _mm_loadl_epi64(reinterpret_cast<const __m128i *>(previous + 8)));
+    return ~_mm_movemask_epi8(_mm_packs_epi16(general, segments)) & ((1 << traceRegisters) - 1);
+#else
+    int changed = 0;
+    for (int k = 0; k < traceRegisters; k++)
+    {
+        changed |= (now[k] != previous[k]) << k; // no branch, the pattern changes every instruction
+    }
+    return changed;
+#endif
+}
+
+int lowestSetBit(int bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    int k = 0;
+    while ((bits & (1 << k)) == 0)
+    {
+        k++;
+    }
+    return k;
+#endif
+}
+
+u16 packTraceFlags(u16 flags)
+{
+    // C P A Z S O T I D to bits 0-8, so a typical arithmetic change fits one varint byte
+    return (flags & 0x1) | ((flags >> 1) & 0x2) | ((flags >> 2) & 0x4) | ((flags >> 3) & 0x18) |
+           ((flags >> 6) & 0x20) | ((flags >> 2) & 0x1C0);
+}
+
+u16 unpackTraceFlags(uint32_t packed)
+{
+    return (packed & 0x1) | ((packed & 0x2) << 1) | ((packed & 0x4) << 2) | ((packed & 0x18) << 3) |
+           ((packed & 0x20) << 6) | ((packed & 0x1C0) << 2);
+}
+
+u8 *putVarint(u8 *cursor, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *cursor++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *cursor++ = value;
+    return cursor;
+}
+
+uint32_t zigzag(int delta)
+{
+    // Small changes either way take one byte, deltas wrap at 16 bits like the registers
+    i16 wrapped = (i16)delta;
+    return (uint32_t)(((int)wrapped << 1) ^ ((int)wrapped >> 15)) & 0x1FFFF;
+}
+
+int viewTrace(const string &path, const TraceFilter &filter)
+{
+    InputImage image;
+    if (!openInput(path, image))
+    {
+        cout << "Error opening file" << endl;
+        return 1;
+    }
+    if ((image.size < sizeof(traceMagic)) || (memcmp(image.data, traceMagic, sizeof(traceMagic)) != 0))
+    {
+        cout << "Not a trace file" << endl;
+        closeInput(image);
+        return 1;
+    }
+
+    // Replay the records against a running copy of the registers, flags and code bytes
+    const u8 *cursor = reinterpret_cast<const u8 *>(image.data) + sizeof(traceMagic);
+    const u8 *end = reinterpret_cast<const u8 *>(image.data) + image.size;
+    vector<char> code(65536 + maxInstructionSize, 0);
+    CPU cpu;
+    u16 flags = 0;
+    int expectedIp = 0;
+    long long index = 0;
+    bool ok = true;
+    while (cursor < end)
+    {
+        u8 tag = *cursor++;
+        int ip = expectedIp;
+        if (tag & traceHasIp)
+        {
+            ip = (expectedIp + unzigzag(getVarint(cursor, end, ok))) & sixteenBitMask;
+        }
+        int size = tag & traceSizeMask;
+        if ((cursor + size) > end)
+        {
+            ok = false;
+            break;
+        }
+        memcpy(&code[ip], cursor, size);
+        cursor += size;
+
+        u16 oldFlags = flags;
+        if (tag & traceHasFlags)
+        {
+            flags ^= unpackTraceFlags(getVarint(cursor, end, ok));
+        }
+        // A mask byte the tag promises but the file lacks is a truncated record, not an empty one
+        int changed = 0;
+        int maskBytes = ((tag & traceHasRegisters) ? 1 : 0) + ((tag & traceHasSegments) ? 1 : 0);
+        if (!ok || ((cursor + maskBytes) > end))
+        {
+            ok = false;
+            break;
+        }
+        if (tag & traceHasRegisters)
+        {
+            changed |= *cursor++;
+        }
+        if (tag & traceHasSegments)
+        {
+            changed |= *cursor++ << 8;
+        }
+        CPU before = cpu;
+        for (int k = 0; k < traceRegisters; k++)
+        {
+            if (changed & (1 << k))
+            {
+                cpu.regSlots[k] += unzigzag(getVarint(cursor, end, ok));
+            }
+        }
+        if (!ok)
+        {
+            break;
+        }
+
+        instruction command(unknown);
+        decodeInstruction(&code[ip], command);
+        expectedIp = (ip + command.size) & sixteenBitMask;
+        cpu.regSlots[12] = expectedIp;
+
+        char line[maxLineLength];
+        string_view text = (command.op_tag == unknown) ? string_view("(unknown)") : string_view(line, formatCommand(command, line));
+        if ((ip >= filter.first) && (ip <= filter.last) && (text.find(filter.match) != string::npos))
+        {
+            printTraceRecord(index, ip, text, before, cpu, oldFlags, flags);
+        }
+        index++;
+    }
+    flushOutput();
+    closeInput(image);
+    if (!ok)
+    {
+        cout << "Trace is truncated after record " << index << endl;
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t getVarint(const u8 *&cursor, const u8 *end, bool &ok)
+{
+    uint32_t value = 0;
+    for (int shift = 0; shift < 32; shift += 7)
+    {
+        if (cursor >= end)
+        {
+            ok = false;
+            return 0;
+        }
+        u8 byte = *cursor++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    ok = false;
+    return value;
+}
+
+int unzigzag(uint32_t value)
+{
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+void printTraceRecord(long long index, int ip, string_view text, const CPU &before, const CPU &after, u16 oldFlags, u16 flags)
+{
+    // e.g. "12 ip 9: add si, 2 ; si: 0->2 flags: PZ->"
+    string line = to_string(index) + " ip " + to_string(ip) + ": ";
+    line.append(text);
+    line += " ;";
+    for (int k = 0; k < traceRegisters; k++)
+    {
+        if (after.regSlots[k] != before.regSlots[k])
+        {
+            line += " " + regList[k] + ": " + to_string(before.regSlots[k]) + "->" + to_string(after.regSlots[k]);
+        }
+    }
+    if (flags != oldFlags)
+    {
+        line += " flags: ";
+        for (int l = 0; l < 9; l++)
+        {
+            if ((oldFlags >> flagsListMask[l]) & 1)
+            {
+                line += flagsList[flagsListMask[l]];
+            }
+        }
+        line += "->";
+        for (int l = 0; l < 9; l++)
+        {
+            if ((flags >> flagsListMask[l]) & 1)
+            {
+                line += flagsList[flagsListMask[l]];
+            }
+        }
+    }
+    line += '\n';
+    writeOutput(line);
+}
+
+long long runBlocks(Engine engine, CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, RunLimits *limits)
+{
+    if ((engine == Engine::threaded) || (engine == Engine::jit))
+    {
+        threadedHandlerTable();
+    }
+
+    // The code buffer is mapped on a thread's first JIT run and made writable from the start again once
+    // half of it holds code of finished runs
+    thread_local JitBuffer jit;
+    if ((engine == Engine::jit) && (jit.code == nullptr))
+    {
+        openJitBuffer(jit);
+    }
+    else if ((engine == Engine::jit) && (jit.used > jit.capacity / 2))
+    {
+        recycleJitBuffer(jit);
+    }
+
+    // The lookup tables stay allocated per thread, so back-to-back runs only clear them
+    thread_local vector<Block *> blocks;
+    thread_local vector<u8> entries;
+    blocks.assign(codeEnd, nullptr);
+    entries.assign(codeEnd, 0);
+
+    long long executed = 0;
+    vector<Block *> live;
+    Block *block = nullptr;
+    try
+    {
+        while ((cpu.regSlots[12] & sixteenBitMask) < codeEnd)
+        {
+            int ip = cpu.regSlots[12] & sixteenBitMask;
+
+            // Quiet runs are back here by their next limit check
+            long long stopAt = LLONG_MAX;
+            if (limits != nullptr)
+            {
+                stopAt = (limits->maxInstructions > 0) ? min(limits->nextCheck, limits->maxInstructions) : limits->nextCheck;
+            }
+
+            if (block == nullptr)
+            {
+                // Most code in a real program runs only a few times, too few to pay back its translation,
+                // so it is interpreted until a loop back edge reaches code whose entries reach translateThreshold
+                if ((blocks[ip] == nullptr) && (++entries[ip] < translateThreshold))
+                {
+                    interpretCold(cpu, memory, flag, codeEnd, trace, executed, stopAt, entries);
+                }
+                else
+                {
+                    if (blocks[ip] == nullptr)
+                    {
+                        blocks[ip] = translateBlock(memory, ip, codeEnd, trace);
+                        live.push_back(blocks[ip]);
+                    }
+                    block = blocks[ip];
+                }
+            }
+
+            if (block != nullptr)
+            {
+                if (block->ops[0].kind == uop_block_end)
+                {
+                    throw runtime_error("Invalid Optag");
+                }
+
+                // Hot blocks are compiled once, anything the JIT can't take stays threaded
+                if ((engine == Engine::jit) && (block->native == nullptr) && (++block->hits == jitThreshold))
+                {
+                    compileHotBlocks(jit, *block, memory, trace);
+                }
+
+                int exit;
+                if (block->native != nullptr)
+                {
+                    // Linked successors that are compiled too run on without coming back here
+                    JitExit taken = block->native(cpu.regSlots, &memory, &flag, &executed, stopAt);
+                    exit = taken.exit;
+                    block = taken.block;
+                    if (jitError != nullptr)
+                    {
+                        exception_ptr error = jitError;
+                        jitError = nullptr;
+                        rethrow_exception(error);
+                    }
+                }
+                else if (engine == Engine::threaded)
+                {
+                    // Linked successors run on without coming back here
+                    exit = executeThreaded(block, cpu, memory, flag, trace, &executed, stopAt, nullptr);
+                }
+                else if (engine == Engine::jit)
+                {
+                    // Every entry counts towards compiling a block, so the JIT doesn't chain threaded blocks
+                    exit = executeThreaded(block, cpu, memory, flag, trace, &executed, 0, nullptr);
+                }
+                else
+                {
+                    // Linked successors run on without coming back here
+                    exit = executeBlock(block, cpu, memory, flag, trace, executed, stopAt);
+                }
+
+                // Follow the chained exit, linking it once its target is translated
+                Block *&successor = block->next[exit];
+                ip = cpu.regSlots[12] & sixteenBitMask;
+                if ((successor == nullptr) && (ip < codeEnd))
+                {
+                    successor = blocks[ip];
+                }
+                block = successor;
+            }
+
+            // Stores into the program throw away the translations holding the bytes stored to
+            if (memory.codeModified)
+            {
+                dropStaleBlocks(blocks, live, memory.modifiedFirst, memory.modifiedLast);
+                memory.codeModified = false;
+                memory.modifiedLast = -1;
+                block = nullptr;
+            }
+
+            // Quiet runs check their budget between blocks, so they can overrun it by one block
+            if ((limits != nullptr) && ((cpu.regSlots[12] & sixteenBitMask) < codeEnd) && limitReached(*limits, executed))
+            {
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        releaseBlocks(live);
+        throw;
+    }
+
+    releaseBlocks(live);
+    return executed;
+}
+
+void dropStaleBlocks(vector<Block *> &blocks, vector<Block *> &live, int first, int last)
+{
+    vector<Block *> stale;
+    for (size_t k = 0; k < live.size();)
+    {
+        Block *block = live[k];
+        if ((block->start <= last) && (block->end > first))
+        {
+            stale.push_back(block);
+            blocks[block->start] = nullptr;
+            live[k] = live.back();
+            live.pop_back();
+        }
+        else
+        {
+            k++;
+        }
+    }
+
+    // Unlink the survivors chained to a dropped block, its native code is never entered again
+    for (Block *block : live)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            if (find(stale.begin(), stale.end(), block->next[k]) != stale.end())
+            {
+                block->next[k] = nullptr;
+            }
+        }
+    }
+    for (Block *block : stale)
+    {
+        delete block;
+    }
+}
+
+void interpretCold(CPU &cpu, Memory &memory, Flags &flag, int codeEnd, bool trace, long long &executed, long long stopAt, vector<u8> &entries)
+{
+    // Same loop as runInterpreter, stopping where code turns hot: after a jump taken backwards to an
+    // address entered translateThreshold times, which every translated block's start has been
+    long long count = executed;
+    while (((cpu.regSlots[12] & sixteenBitMask) < codeEnd) && (count < stopAt))
+    {
+        const instruction &command = fetchInstruction(memory, cpu.regSlots[12] & sixteenBitMask);
+        if (command.op_tag == unknown)
+        {
+            throw runtime_error("Invalid Optag");
+        }
+        if (trace)
+        {
+            printCommand(command);
+        }
+
+        int from = cpu.regSlots[12] & sixteenBitMask;
+        bool jump = (command.op_tag == conditional_jump);
+        cpu.regSlots[12] += command.size;
+        executeCommand(command, cpu, memory, flag);
+        count++;
+        int to = cpu.regSlots[12] & sixteenBitMask;
+        if (jump && (to <= from))
+        {
+            // runBlocks counts the entry it is handed back
+            if (entries[to] + 1 >= translateThreshold)
+            {
+                break;
+            }
+            entries[to]++;
+        }
+    }
+    executed = count;
+}
+
+void releaseBlocks(vector<Block *> &live)
+{
+    for (Block *block : live)
+    {
+        delete block;
+    }
+    live.clear();
+}
+
+Block *translateBlock(Memory &memory, int ip, int codeEnd, bool trace)
+{
+    Block *block = new Block;
+    block->start = ip;
+    block->ops.reserve(blockReserve);
+    bool terminated = false;
+    while ((ip < codeEnd) && !terminated)
+    {
+        const instruction &command = fetchInstruction(memory, ip);
+        if (command.op_tag == unknown)
+        {
+            break;
+        }
+
+        MicroOp op = translateInstruction(command, ip);
+        ip += command.size;
+        op.next = ip;
+        block->ops.push_back(op);
+        if (trace)
+        {
+            char line[maxLineLength];
+            size_t length = formatCommand(command, line);
+            line[length] = '\n';
+            block->text.emplace_back(line, length + 1);
+        }
+        terminated = (command.op_tag == conditional_jump);
+    }
+    block->end = ip;
+
+    // Blocks that run off the end of straight-line code fall through to the next address
+    if (!terminated)
+    {
+        MicroOp op = {};
+        op.kind = uop_block_end;
+        op.next = ip;
+        block->ops.push_back(op);
+        if (trace)
+        {
+            block->text.push_back("");
+        }
+    }
+
+    const void *const *handlers = threadedHandlerTable();
+    for (MicroOp &op : block->ops)
+    {
+        op.handler = handlers[op.kind];
+    }
+    return block;
+}
+
+MicroOp translateInstruction(const instruction &inst1, int ip)
+{
+    MicroOp op = {};
+    op.kind = uop_generic;
+    op.mnemonic = inst1.mnemonic;
+    op.w = inst1.w;
+    bool isMov = (inst1.mnemonic == mov);
+    bool isWord = (inst1.w == Word);
+
+    // add/sub/cmp kinds are laid out as four forms per mnemonic
+    int arithFirst = uop_add_reg16_reg16;
+    if (inst1.mnemonic == sub)
+    {
+        arithFirst = uop_sub_reg16_reg16;
+    }
+    else if (inst1.mnemonic == cmp)
+    {
+        arithFirst = uop_cmp_reg16_reg16;
+    }
+
+    switch (inst1.op_tag)
+    {
+    case conditional_jump:
+        op.data = inst1.cond_jmp.data;
+        op.condition = inst1.cond_jmp.condition;
+        switch (inst1.mnemonic)
+        {
+        case loop:
+            op.kind = uop_loop;
+            break;
+        case loopz:
+            op.kind = uop_loopz;
+            break;
+        case loopnz:
+            op.kind = uop_loopnz;
+            break;
+        case jcxz:
+            op.kind = uop_jcxz;
+            break;
+        default:
+            op.kind = uop_jcc;
+            break;
+        }
+        break;
+    case immediate_to_register:
+        op.dest = inst1.imm_to_reg.dest;
+        op.data = isWord ? inst1.imm_to_reg.data : (inst1.imm_to_reg.data & lowBitsMask);
+        if (isMov)
+        {
+            op.kind = isWord ? uop_mov_reg16_imm : uop_mov_reg8_imm;
+        }
+        else
+        {
+            op.kind = (MicroOpKind)(arithFirst + (isWord ? 2 : 3));
+        }
+        break;
+    case immediate_to_register_mem:
+        op.data = inst1.imm_to_reg_mem.data;
+        if (inst1.imm_to_reg_mem.mod == register_mode)
+        {
+            op.dest = inst1.imm_to_reg_mem.dest;
+            if (isMov)
+            {
+                op.kind = isWord ? uop_mov_reg16_imm : uop_mov_reg8_imm;
+                op.data = isWord ? op.data : (op.data & lowBitsMask);
+            }
+            else
+            {
+                op.kind = (MicroOpKind)(arithFirst + (isWord ? 2 : 3));
+            }
+        }
+        else if (isMov)
+        {
+            op.kind = isWord ? uop_mov_mem_imm16 : uop_mov_mem_imm8;
+            op.disp = inst1.imm_to_reg_mem.disp;
+        }
+        break;
+    case register_mem_to_from_register:
+        if (inst1.reg_mem_to_from_reg.mod == register_mode)
+        {
+            op.source = inst1.reg_mem_to_from_reg.source;
+            op.dest = inst1.reg_mem_to_from_reg.dest;
+            if (isMov)
+            {
+                op.kind = isWord ? uop_mov_reg16_reg16 : uop_mov_reg8_reg8;
+            }
+            else
+            {
+                op.kind = (MicroOpKind)(arithFirst + (isWord ? 0 : 1));
+            }
+        }
+        else if (isMov && (inst1.reg_mem_to_from_reg.d == register_is_source))
+        {
+            op.kind = isWord ? uop_mov_mem_reg16 : uop_mov_mem_reg8;
+            op.source = inst1.reg_mem_to_from_reg.source;
+            op.disp = inst1.reg_mem_to_from_reg.disp;
+        }
+        else if (isMov)
+        {
+            op.kind = isWord ? uop_mov_reg16_mem : uop_mov_reg8_mem;
+            op.dest = inst1.reg_mem_to_from_reg.dest;
+            op.disp = inst1.reg_mem_to_from_reg.disp;
+        }
+        break;
+    case register_mem_to_from_seg_register:
+        // Writes to a segment register stay generic so emulateCommand updates its base
+        if ((inst1.reg_mem_to_from_seg_reg.mod == register_mode) && (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_source))
+        {
+            op.kind = uop_mov_reg16_reg16;
+            op.dest = inst1.reg_mem_to_from_seg_reg.operandOne;
+            op.source = getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo) * 2;
+        }
+        break;
+    case memory_to_acc_or_vv:
+        // al or ax to or from a direct address, register offset 0 either way
+        op.disp = inst1.mem_to_acc.disp;
+        if (inst1.mem_to_acc.d == accumulator_is_source)
+        {
+            op.kind = isWord ? uop_mov_mem_reg16 : uop_mov_mem_reg8;
+        }
+        else
+        {
+            op.kind = isWord ? uop_mov_reg16_mem : uop_mov_reg8_mem;
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Register operands and encodings without ModRM get no base or index from the table
+    const ModRMInfo &ea = modRMTable.entries[inst1.modRM];
+    op.base = ea.base;
+    op.index = ea.index;
+    op.segment = inst1.segment;
+
+    // The decode cache entry outlives the block, a store over it drops the block first
+    if (op.kind == uop_generic)
+    {
+        op.data = ip;
+    }
+    return op;
+}
+
+int executeBlock(Block *&block, CPU &cpu, Memory &memory, Flags &flag, bool trace, long long &executed, long long chainUntil)
+{
+    i16 *regs = cpu.regSlots;
+    u8 *bytes = regBytes(cpu);
+    while (true)
+    {
+        const MicroOp *first = block->ops.data();
+        const MicroOp *op = first;
+        int exit = -1;
+        while (exit < 0)
+        {
+            if (trace && (op->kind != uop_block_end))
+            {
+                writeOutput(block->text[op - first]);
+            }
+
+            // One case per kind, so only the memory kinds form an effective address and the
+            // mnemonic and width of every add/sub/cmp are constants
+            int address = 0;
+            u32 segmentBase = 0;
+            int source = 0;
+            i32 result = 0;
+            switch (op->kind)
+            {
+            case uop_mov_reg16_imm:
+                regs[op->dest >> 1] = op->data;
+                break;
+            case uop_mov_reg8_imm:
+                bytes[op->dest] = op->data;
+                break;
+            case uop_mov_reg16_reg16:
+                regs[op->dest >> 1] = regs[op->source >> 1];
+                break;
+            case uop_mov_reg8_reg8:
+                bytes[op->dest] = bytes[op->source];
+                break;
+            case uop_mov_reg16_mem:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                regs[op->dest >> 1] = (readMemory(memory, segmentBase, address + 1) << 8) + (readMemory(memory, segmentBase, address) & lowBitsMask);
+                break;
+            case uop_mov_reg8_mem:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                bytes[op->dest] = readMemory(memory, segmentBase, address);
+                break;
+            case uop_mov_mem_reg16:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                writeMemory(memory, segmentBase, address, regs[op->source >> 1] & lowBitsMask);
+                writeMemory(memory, segmentBase, address + 1, regs[op->source >> 1] >> 8);
+                break;
+            case uop_mov_mem_reg8:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                writeMemory(memory, segmentBase, address, bytes[op->source]);
+                break;
+            case uop_mov_mem_imm16:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                writeMemory(memory, segmentBase, address, op->data & lowBitsMask);
+                writeMemory(memory, segmentBase, address + 1, op->data >> 8);
+                break;
+            case uop_mov_mem_imm8:
+                address = op->disp + regs[op->base] + regs[op->index];
+                segmentBase = cpu.segmentBase[op->segment - 8];
+                writeMemory(memory, segmentBase, address, op->data);
+                break;
+            case uop_add_reg16_reg16:
+                source = regs[op->source >> 1];
+                result = regs[op->dest >> 1] + source;
+                regs[op->dest >> 1] = result;
+                setFlags(add, Word, result, source, flag);
+                break;
+            case uop_add_reg8_reg8:
+                source = bytes[op->source];
+                result = byteResult(add, regs[op->dest >> 1], op->dest, source, true);
+                bytes[op->dest] += source;
+                setFlags(add, Byte, result, source, flag);
+                break;
+            case uop_add_reg16_imm:
+                source = op->data;
+                result = regs[op->dest >> 1] + source;
+                regs[op->dest >> 1] = result;
+                setFlags(add, Word, result, source, flag);
+                break;
+            case uop_add_reg8_imm:
+                source = op->data;
+                result = byteResult(add, regs[op->dest >> 1], op->dest, source, false);
+                bytes[op->dest] += source;
+                setFlags(add, Byte, result, source, flag);
+                break;
+            case uop_sub_reg16_reg16:
+                source = regs[op->source >> 1];
+                result = regs[op->dest >> 1] - source;
+                regs[op->dest >> 1] = result;
+                setFlags(sub, Word, result, source, flag);
+                break;
+            case uop_sub_reg8_reg8:
+                source = bytes[op->source];
+                result = byteResult(sub, regs[op->dest >> 1], op->dest, source, true);
+                bytes[op->dest] -= source;
+                setFlags(sub, Byte, result, source, flag);
+                break;
+            case uop_sub_reg16_imm:
+                source = op->data;
+                result = regs[op->dest >> 1] - source;
+                regs[op->dest >> 1] = result;
+                setFlags(sub, Word, result, source, flag);
+                break;
+            case uop_sub_reg8_imm:
+                source = op->data;
+                result = byteResult(sub, regs[op->dest >> 1], op->dest, source, false);
+                bytes[op->dest] -= source;
+                setFlags(sub, Byte, result, source, flag);
+                break;
+            case uop_cmp_reg16_reg16:
+                source = regs[op->source >> 1];
+                result = regs[op->dest >> 1] - source;
+                setFlags(cmp, Word, result, source, flag);
+                break;
+            case uop_cmp_reg8_reg8:
+                source = bytes[op->source];
+                result = byteResult(cmp, regs[op->dest >> 1], op->dest, source, true);
+                setFlags(cmp, Byte, result, source, flag);
+                break;
+            case uop_cmp_reg16_imm:
+                source = op->data;
+                result = regs[op->dest >> 1] - source;
+                setFlags(cmp, Word, result, source, flag);
+                break;
+            case uop_cmp_reg8_imm:
+                source = op->data;
+                result = byteResult(cmp, regs[op->dest >> 1], op->dest, source, false);
+                setFlags(cmp, Byte, result, source, flag);
+                break;
+            case uop_jcc:
+            case uop_loop:
+            case uop_loopz:
+            case uop_loopnz:
+            case uop_jcxz:
+                executed += op - first + 1;
+                regs[12] = block->end;
+                exit = 0;
+                if (branchTaken(op->mnemonic, op->condition, cpu, flag))
+                {
+                    regs[12] += op->data;
+                    exit = 1;
+                }
+                break;
+            case uop_generic:
+                executeCommand(memory.decodeCache[op->data], cpu, memory, flag);
+                break;
+            case uop_block_end:
+                executed += op - first;
+                regs[12] = block->end;
+                exit = 0;
+                break;
+            }
+
+            // Leave the block right after a store into the program so it can be retranslated,
+            // only stores and generic ops ever set codeModified
+            if (memory.codeModified)
+            {
+                executed += op - first + 1;
+                regs[12] = op->next;
+                return 0;
+            }
+            op++;
+        }
+
+        // Go straight on into a successor runBlocks has already linked, as executeThreaded does
+        if ((block->next[exit] == nullptr) || (executed >= chainUntil))
+        {
+            return exit;
+        }
+        block = block->next[exit];
+    }
+}
+
+// Label addresses of executeThreaded's handlers, indexed by MicroOpKind. Labels can only be named inside
+// their own function, so executeThreaded hands the table out when called without a block; the static
+// makes that happen once, even when several threads ask at the same time
+const void *const *threadedHandlerTable()
+{
+    static const void *const *const table = []()
+    {
+        const void *const *handlers = nullptr;
+        CPU cpu;
+        Memory memory = {vector<i8>(), {}, false, 0, -1}; // never read, so no 1 MB behind it
+        Block *none = nullptr;
+        executeThreaded(none, cpu, memory, cpu.flag, false, nullptr, 0, &handlers);
+        return handlers;
+    }();
+    return table;
+}
+
+int executeThreaded(Block *&block, CPU &cpu, Memory &memory, Flags &flag, bool trace, long long *executed, long long chainUntil,
+                    const void *const **handlerTable)
+{
+    // One label per MicroOpKind, in declaration order
+    static const void *handlers[] = {
+        &&mov_reg16_imm, &&mov_reg8_imm, &&mov_reg16_reg16, &&mov_reg8_reg8,
+        &&mov_reg16_mem, &&mov_reg8_mem, &&mov_mem_reg16, &&mov_mem_reg8,
+        &&mov_mem_imm16, &&mov_mem_imm8,
+        &&add_reg16_reg16, &&add_reg8_reg8, &&add_reg16_imm, &&add_reg8_imm,
+        &&sub_reg16_reg16, &&sub_reg8_reg8, &&sub_reg16_imm, &&sub_reg8_imm,
+        &&cmp_reg16_reg16, &&cmp_reg8_reg8, &&cmp_reg16_imm, &&cmp_reg8_imm,
+        &&jcc, &&loop, &&loopz, &&loopnz, &&jcxz,
+        &&generic, &&block_end};
+
+    // Called without a block from threadedHandlerTable, only give out the handler addresses
+    if (block == nullptr)
+    {
+        *handlerTable = handlers;
+        return 0;
+    }
+
+    i16 *regs = cpu.regSlots;
+    u8 *bytes = regBytes(cpu);
+    const MicroOp *first = block->ops.data();
+    const MicroOp *op = first;
+    int address = 0;
+    u32 segmentBase = 0;
+    int source = 0;
+    i32 result = 0;
+    int exit = 0;
+
+// Print the next op when tracing, then jump straight to its handler
+#define DISPATCH()                                          \
+    do                                                      \
+    {                                                       \
+        if (trace && (op->kind != uop_block_end))           \
+        {                                                   \
+            writeOutput(block->text[op - first]);           \
+        }                                                   \
+        goto *op->handler;                                  \
+    } while (0)
+
+#define NEXT() \
+    op++;      \
+    DISPATCH()
+
+// Jumps end the block, taking exit 1 to the branch target or exit 0 to fall through
+#define TAKE_BRANCH(taken)                                  \
+    exit = (taken) ? 1 : 0;                                 \
+    *executed += (op - first) + 1;                          \
+    regs[12] = block->end + (exit ? op->data : 0);          \
+    goto chain
+
+// Leave the block right after a store into the program so it can be retranslated
+#define CHECK_CODE_MODIFIED()                   \
+    if (memory.codeModified)                    \
+    {                                           \
+        *executed += (op - first) + 1;          \
+        regs[12] = op->next;                    \
+        return 0;                               \
+    }
+
+    DISPATCH();
+
+mov_reg16_imm:
+    regs[op->dest >> 1] = op->data;
+    NEXT();
+mov_reg8_imm:
+    bytes[op->dest] = op->data;
+    NEXT();
+mov_reg16_reg16:
+    regs[op->dest >> 1] = regs[op->source >> 1];
+    NEXT();
+mov_reg8_reg8:
+    bytes[op->dest] = bytes[op->source];
+    NEXT();
+mov_reg16_mem:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    regs[op->dest >> 1] = (readMemory(memory, segmentBase, address + 1) << 8) + (readMemory(memory, segmentBase, address) & lowBitsMask);
+    NEXT();
+mov_reg8_mem:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    bytes[op->dest] = readMemory(memory, segmentBase, address);
+    NEXT();
+mov_mem_reg16:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    writeMemory(memory, segmentBase, address, regs[op->source >> 1] & lowBitsMask);
+    writeMemory(memory, segmentBase, address + 1, regs[op->source >> 1] >> 8);
+    CHECK_CODE_MODIFIED();
+    NEXT();
+mov_mem_reg8:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    writeMemory(memory, segmentBase, address, bytes[op->source]);
+    CHECK_CODE_MODIFIED();
+    NEXT();
+mov_mem_imm16:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    writeMemory(memory, segmentBase, address, op->data & lowBitsMask);
+    writeMemory(memory, segmentBase, address + 1, op->data >> 8);
+    CHECK_CODE_MODIFIED();
+    NEXT();
+mov_mem_imm8:
+    address = op->disp + regs[op->base] + regs[op->index];
+    segmentBase = cpu.segmentBase[op->segment - 8];
+    writeMemory(memory, segmentBase, address, op->data);
+    CHECK_CODE_MODIFIED();
+    NEXT();
+
+add_reg16_reg16:
+    source = regs[op->source >> 1];
+    result = regs[op->dest >> 1] + source;
+    regs[op->dest >> 1] = result;
+    setFlags(add, Word, result, source, flag);
+    NEXT();
+add_reg8_reg8:
+    source = bytes[op->source];
+    result = byteResult(add, regs[op->dest >> 1], op->dest, source, true);
+    bytes[op->dest] += source;
+    setFlags(add, Byte, result, source, flag);
+    NEXT();
+add_reg16_imm:
+    source = op->data;
+    result = regs[op->dest >> 1] + source;
+    regs[op->dest >> 1] = result;
+    setFlags(add, Word, result, source, flag);
+    NEXT();
+add_reg8_imm:
+    source = op->data;
+    result = byteResult(add, regs[op->dest >> 1], op->dest, source, false);
+    bytes[op->dest] += source;
+    setFlags(add, Byte, result, source, flag);
+    NEXT();
+
+sub_reg16_reg16:
+    source = regs[op->source >> 1];
+    result = regs[op->dest >> 1] - source;
+    regs[op->dest >> 1] = result;
+    setFlags(sub, Word, result, source, flag);
+    NEXT();
+sub_reg8_reg8:
+    source = bytes[op->source];
+    result = byteResult(sub, regs[op->dest >> 1], op->dest, source, true);
+    bytes[op->dest] -= source;
+    setFlags(sub, Byte, result, source, flag);
+    NEXT();
+sub_reg16_imm:
+    source = op->data;
+    result = regs[op->dest >> 1] - source;
+    regs[op->dest >> 1] = result;
+    setFlags(sub, Word, result, source, flag);
+    NEXT();
+sub_reg8_imm:
+    source = op->data;
+    result = byteResult(sub, regs[op->dest >> 1], op->dest, source, false);
+    bytes[op->dest] -= source;
+    setFlags(sub, Byte, result, source, flag);
+    NEXT();
+
+cmp_reg16_reg16:
+    source = regs[op->source >> 1];
+    result = regs[op->dest >> 1] - source;
+    setFlags(cmp, Word, result, source, flag);
+    NEXT();
+cmp_reg8_reg8:
+    source = bytes[op->source];
+    result = byteResult(cmp, regs[op->dest >> 1], op->dest, source, true);
+    setFlags(cmp, Byte, result, source, flag);
+    NEXT();
+cmp_reg16_imm:
+    source = op->data;
+    result = regs[op->dest >> 1] - source;
+    setFlags(cmp, Word, result, source, flag);
+    NEXT();
+cmp_reg8_imm:
+    source = op->data;
+    result = byteResult(cmp, regs[op->dest >> 1], op->dest, source, false);
+    setFlags(cmp, Byte, result, source, flag);
+    NEXT();
+
+jcc:
+    TAKE_BRANCH(conditionHolds(op->condition, flag));
+loop:
+    regs[2] -= 1;
+    TAKE_BRANCH(regs[2] != 0);
+loopz:
+    regs[2] -= 1;
+    TAKE_BRANCH(testFlags(flag, flagZF) && (regs[2] != 0));
+loopnz:
+    regs[2] -= 1;
+    TAKE_BRANCH(!testFlags(flag, flagZF) && (regs[2] != 0));
+jcxz:
+    TAKE_BRANCH(regs[2] == 0);
+
+generic:
+    executeCommand(memory.decodeCache[op->data], cpu, memory, flag);
+    CHECK_CODE_MODIFIED();
+    NEXT();
+block_end:
+    exit = 0;
+    *executed += op - first;
+    regs[12] = block->end;
+
+chain:
+    // Go straight on into a successor runBlocks has already linked, leaving block at the one that ran last
+    if ((block->next[exit] != nullptr) && (*executed < chainUntil))
+    {
+        block = block->next[exit];
+        first = block->ops.data();
+        op = first;
+        DISPATCH();
+    }
+    return exit;
+
+#undef DISPATCH
+#undef NEXT
+#undef TAKE_BRANCH
+#undef CHECK_CODE_MODIFIED
+}
+
+// A block that turned hot is compiled with the linked blocks close behind it, so a loop's blocks go native
+// together and the buffer is switched to executable once for all of them
+void compileHotBlocks(JitBuffer &jit, Block &root, Memory &memory, bool trace)
+{
+    vector<Block *> pending = {&root};
+    while (!pending.empty())
+    {
+        Block *block = pending.back();
+        pending.pop_back();
+        if (block->native != nullptr)
+        {
+            continue;
+        }
+        block->native = compileBlock(jit, *block, memory, trace);
+        if (block->native == nullptr)
+        {
+            continue;
+        }
+        for (Block *successor : block->next)
+        {
+            if ((successor != nullptr) && (successor->native == nullptr) && (successor->hits >= jitThreshold / 2))
+            {
+                pending.push_back(successor);
+            }
+        }
+    }
+    sealJitBuffer(jit);
+}
+
+// x86-64 JIT, native code keeps regs in rbx, memory in r12, flags in r13, the executed count in r14, the
+// count it chains until in r15 and cx in bp, the executed counter's address is on top of the stack
+JitFunction compileBlock(JitBuffer &jit, Block &block, Memory &memory, bool trace)
+{
+#if JIT_SUPPORTED
+    vector<u8> code;
+    auto emit = [&code](initializer_list<int> bytes)
+    {
+        for (int b : bytes)
+        {
+            code.push_back(b);
+        }
+    };
+    auto emit16 = [&code](int value)
+    {
+        code.push_back(value & 0xFF);
+        code.push_back((value >> 8) & 0xFF);
+    };
+    auto emit32 = [&code](int value)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            code.push_back((value >> (8 * k)) & 0xFF);
+        }
+    };
+    auto emit64 = [&code](const void *pointer)
+    {
+        uint64_t value = reinterpret_cast<uint64_t>(pointer);
+        for (int k = 0; k < 8; k++)
+        {
+            code.push_back((value >> (8 * k)) & 0xFF);
+        }
+    };
+
+    // Register file operands are [rbx + disp8], micro-op registers are byte offsets already,
+    // effective address registers are word slots
+    auto slot = [](int reg)
+    {
+        return reg * 2;
+    };
+    auto segmentSlot = [](int segment)
+    {
+        return (int)offsetof(CPU, segmentBase) + (segment - 8) * 4;
+    };
+    auto call = [&](const void *function)
+    {
+        emit({0x48, 0xB8}); // mov rax, imm64
+        emit64(function);
+        emit({0xFF, 0xD0}); // call rax
+    };
+
+    // Skip the following exit with a short jump, patched once the exit is emitted
+    auto jumpOver = [&](int opcode)
+    {
+        emit({opcode, 0});
+        return code.size();
+    };
+    auto patch = [&](size_t from)
+    {
+        code[from - 1] = code.size() - from;
+    };
+
+    // Every block has the same prologue, chained blocks are entered right after it
+    size_t bodyStart = 0;
+    int nativeOffset = reinterpret_cast<u8 *>(&block.native) - reinterpret_cast<u8 *>(&block);
+
+    // cx lives in bp while native code runs, ops reading or writing it through the register file and
+    // everything leaving native code see it stored back
+    auto flushCx = [&]()
+    {
+        emit({0x66, 0x89, 0x6B, 4}); // mov [cx], bp
+    };
+    auto reloadCx = [&]()
+    {
+        emit({0x0F, 0xB7, 0x6B, 4}); // movzx ebp, word [cx]
+    };
+
+    // Record an add/sub/cmp for the lazy flags, as setFlags does, from eax and ecx or from r8d and r9d
+    auto emitRecord = [&](Mnemonic mnemonic, WFlag w, bool kept)
+    {
+        int rex = kept ? 0x45 : 0x41;
+        emit({0x41, 0xC6, 0x45, (int)offsetof(Flags, pending), 1});      // mov byte [r13 + pending], 1
+        emit({0x41, 0xC6, 0x45, (int)offsetof(Flags, lastMnemonic), mnemonic}); // mov byte [r13 + lastMnemonic], imm8
+        emit({0x41, 0xC6, 0x45, (int)offsetof(Flags, lastW), w});               // mov byte [r13 + lastW], imm8
+        emit({rex, 0x89, 0x45, (int)offsetof(Flags, lastResult)});       // mov [r13 + lastResult], eax/r8d
+        emit({rex, 0x89, 0x4D, (int)offsetof(Flags, lastSource)});       // mov [r13 + lastSource], ecx/r9d
+    };
+
+    // The last add/sub/cmp before a loop, jcxz or the block end keeps its record in r8d and r9d for the exits
+    // to store, a block looping on itself that overwrites the record before reading it skips that store
+    bool recordKept = false;
+    Mnemonic keptMnemonic = add;
+    WFlag keptW = Word;
+    bool recordOverwrittenFirst = false;
+    for (const MicroOp &op : block.ops)
+    {
+        if ((op.kind >= uop_add_reg16_reg16) && (op.kind <= uop_cmp_reg8_imm))
+        {
+            recordOverwrittenFirst = true;
+            break;
+        }
+        if (op.kind > uop_mov_reg8_mem)
+        {
+            break;
+        }
+    }
+
+    // Leave the block: count the ops run, then either jump into the linked successor when it is compiled
+    // and the executed count is below r15, as executeThreaded chains, or set ip and return the exit taken
+    auto emitExit = [&](int opsRun, int ip, int exit, bool chain)
+    {
+        if (opsRun > 0)
+        {
+            emit({0x49, 0x81, 0xC6}); // add r14, imm32
+            emit32(opsRun);
+        }
+        bool loopsBack = chain && (block.next[exit] == &block);
+        bool storeAfterLoop = loopsBack && recordOverwrittenFirst;
+        if (recordKept && !storeAfterLoop)
+        {
+            emitRecord(keptMnemonic, keptW, true);
+        }
+        if (loopsBack)
+        {
+            // A block looping on itself can't be dropped while it runs, so it jumps straight back
+            emit({0x4D, 0x39, 0xFE}); // cmp r14, r15
+            size_t budgetUsed = jumpOver(0x7D);
+            emit({0xE9}); // jmp bodyStart
+            emit32((int)bodyStart - (int)(code.size() + 4));
+            patch(budgetUsed);
+            if (recordKept && storeAfterLoop)
+            {
+                emitRecord(keptMnemonic, keptW, true);
+            }
+        }
+        else if (chain)
+        {
+            emit({0x48, 0xB8}); // mov rax, imm64
+            emit64(&block.next[exit]);
+            emit({0x48, 0x8B, 0x00, 0x48, 0x85, 0xC0}); // mov rax, [rax]; test rax, rax
+            size_t unlinked = jumpOver(0x74);
+            emit({0x48, 0x8B, 0x80}); // mov rax, [rax + native]
+            emit32(nativeOffset);
+            emit({0x48, 0x85, 0xC0}); // test rax, rax
+            size_t notCompiled = jumpOver(0x74);
+            emit({0x4D, 0x39, 0xFE}); // cmp r14, r15
+            size_t budgetUsed = jumpOver(0x7D);
+            emit({0x48, 0x83, 0xC0, (int)bodyStart, 0xFF, 0xE0}); // add rax, bodyStart; jmp rax
+            patch(unlinked);
+            patch(notCompiled);
+            patch(budgetUsed);
+        }
+        emit({0x66, 0xC7, 0x43, 24}); // mov word [rbx + ip], imm16
+        emit16(ip);
+        flushCx();
+        emit({0x59, 0x4C, 0x89, 0x31}); // pop rcx; mov [rcx], r14
+        emit({0xB8}); // mov eax, imm32
+        emit32(exit);
+        emit({0x48, 0xBA}); // mov rdx, imm64
+        emit64(&block);
+        emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3}); // pop r15, r14, r13, r12, rbp, rbx; ret
+    };
+
+    // Effective address into esi
+    auto emitAddress = [&](const MicroOp &op)
+    {
+        emit({0xBE}); // mov esi, disp
+        emit32(op.disp);
+        if (op.base != zeroSlot)
+        {
+            emit({0x0F, 0xBF, 0x43, slot(op.base), 0x01, 0xC6}); // movsx eax, word [base]; add esi, eax
+        }
+        if (op.index != zeroSlot)
+        {
+            emit({0x0F, 0xBF, 0x43, slot(op.index), 0x01, 0xC6}); // movsx eax, word [index]; add esi, eax
+        }
+    };
+
+    // Physical address of the effective address in esi, plus 0 or 1, into eax or ecx, as readMemory forms it
+    auto emitPhysical = [&](const MicroOp &op, int plus)
+    {
+        if (plus == 0)
+        {
+            emit({0x0F, 0xB7, 0xC6, 0x03, 0x43, segmentSlot(op.segment), 0x25}); // movzx eax, si; add eax, [segment base]; and eax, imm32
+        }
+        else
+        {
+            emit({0x8D, 0x4E, plus, 0x0F, 0xB7, 0xC9}); // lea ecx, [rsi + plus]; movzx ecx, cx
+            emit({0x03, 0x4B, segmentSlot(op.segment), 0x81, 0xE1}); // add ecx, [segment base]; and ecx, imm32
+        }
+        emit32(memoryMask);
+    };
+
+    // Stores return memory.codeModified, leave right after one that hits the program
+    auto emitModifiedCheck = [&](size_t k, const MicroOp &op)
+    {
+        emit({0x84, 0xC0}); // test al, al
+        size_t skip = jumpOver(0x74);
+        emitExit(k + 1, op.next, 0, false);
+        patch(skip);
+    };
+
+    // add/sub/cmp earlier in the block leave a flags record whose mnemonic and width are known here,
+    // so the flags a jump tests are worked out inline from lastResult as computeFlags does
+    bool flagsKnown = false;
+    Mnemonic knownMnemonic = add;
+    WFlag knownW = Word;
+
+    // CF, PF, ZF, SF and OF packed into edx as packFlags packs them, from the known flags record
+    auto emitPackedFlags = [&]()
+    {
+        auto addBit = [&](int setcc, int sib)
+        {
+            emit({0x0F, setcc, 0xC1, 0x0F, 0xB6, 0xC9}); // setcc cl; movzx ecx, cl
+            if (sib != 0)
+            {
+                emit({0x8D, 0x14, sib}); // lea edx, [rdx + rcx * scale]
+            }
+            else
+            {
+                emit({0xC1, 0xE1, 0x04, 0x09, 0xCA}); // shl ecx, 4; or edx, ecx
+            }
+        };
+        emit({0x41, 0x8B, 0x45, (int)offsetof(Flags, lastResult)}); // mov eax, [r13 + lastResult]
+        if (knownMnemonic == add)
+        {
+            emit({0x31, 0xD2, 0x3D, 0xFF, 0x00, 0x00, 0x00, 0x0F, 0x9F, 0xC2}); // xor edx, edx; cmp eax, 255; setg dl
+        }
+        else
+        {
+            emit({0x89, 0xC2, 0xC1, 0xEA, 0x1F}); // mov edx, eax; shr edx, 31
+        }
+        emit({0x84, 0xC0}); // test al, al
+        addBit(0x9A, 0x4A);  // setp
+        emit({0x85, 0xC0}); // test eax, eax
+        addBit(0x94, 0x8A);  // sete
+        emit({0x0F, 0xBA, 0xE0, (knownW == Word) ? 15 : 7}); // bt eax, sign bit
+        addBit(0x92, 0xCA);  // setc
+        emit({0x8D, 0x88}); // lea ecx, [rax + imm32], in range when 0 to the limit unsigned
+        emit32((knownW == Word) ? 32768 : 127);
+        emit({0x81, 0xF9}); // cmp ecx, imm32
+        emit32((knownW == Word) ? 98303 : 382);
+        addBit(0x97, 0);     // seta
+    };
+
+    // Leave x86 ZF set when FLAGS.ZF is clear
+    auto emitZeroFlagTest = [&]()
+    {
+        if (flagsKnown)
+        {
+            emitPackedFlags();
+            emit({0xF6, 0xC2, 0x04}); // test dl, 4
+            return;
+        }
+        emit({0x4C, 0x89, 0xEF}); // mov rdi, r13
+        call(reinterpret_cast<const void *>(&jitReadFlags));
+        emit({0x66, 0xA9}); // test ax, imm16
+        emit16(flagZF);
+    };
+
+    // An add/sub/cmp only records its flags when something that can leave the block or read the flags comes
+    // before the next add/sub/cmp, which would overwrite them: 0 no record, 1 stored right away, 2 kept for
+    // the exits when that something is a loop, jcxz or the block end and no trace call clobbers r8 and r9
+    vector<u8> recordFlags(block.ops.size(), 0);
+    bool overwritten = false;
+    MicroOpKind nextExit = uop_block_end;
+    for (size_t k = block.ops.size(); k-- > 0;)
+    {
+        MicroOpKind kind = block.ops[k].kind;
+        if ((kind >= uop_add_reg16_reg16) && (kind <= uop_cmp_reg8_imm))
+        {
+            if (!overwritten)
+            {
+                bool keep = !trace && ((nextExit == uop_loop) || (nextExit == uop_jcxz) || (nextExit == uop_block_end));
+                recordFlags[k] = keep ? 2 : 1;
+            }
+            overwritten = true;
+        }
+        else if (kind > uop_mov_reg8_mem)
+        {
+            overwritten = false;
+            nextExit = kind;
+        }
+    }
+
+    // Prologue: push rbx, rbp, r12, r13, r14, r15 and the executed counter's address, which keeps the stack
+    // 16 byte aligned, pin the arguments and load the executed count and cx
+    emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x51});
+    emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5, 0x4D, 0x89, 0xC7, 0x4C, 0x8B, 0x31});
+    reloadCx();
+    bodyStart = code.size();
+
+    for (size_t k = 0; k < block.ops.size(); k++)
+    {
+        const MicroOp &op = block.ops[k];
+        if (trace && (op.kind != uop_block_end))
+        {
+            emit({0x48, 0xBF}); // mov rdi, imm64
+            emit64(&block.text[k]);
+            call(reinterpret_cast<const void *>(&jitTrace));
+        }
+
+        int dest = op.dest;
+        int source = op.source;
+        int mnemonicBase = uop_add_reg16_reg16;
+        int form = (op.kind - mnemonicBase) % 4;
+        bool isArith = (op.kind >= uop_add_reg16_reg16) && (op.kind <= uop_cmp_reg8_imm);
+        bool touchesCx = (op.kind <= uop_cmp_reg8_imm) && (((dest >> 1) == 2) || ((source >> 1) == 2));
+        if (touchesCx)
+        {
+            flushCx();
+        }
+        switch (op.kind)
+        {
+        case uop_mov_reg16_imm:
+            emit({0x66, 0xC7, 0x43, dest}); // mov word [dest], imm16
+            emit16(op.data);
+            break;
+        case uop_mov_reg8_imm:
+            emit({0xC6, 0x43, dest, op.data & lowBitsMask}); // mov byte [dest], imm8
+            break;
+        case uop_mov_reg16_reg16:
+            emit({0x0F, 0xB7, 0x43, source, 0x66, 0x89, 0x43, dest}); // movzx eax, word [source]; mov [dest], ax
+            break;
+        case uop_mov_reg8_reg8:
+            emit({0x8A, 0x43, source, 0x88, 0x43, dest}); // mov al, [source]; mov [dest], al
+            break;
+        case uop_mov_reg16_mem:
+            // Each byte wraps inside its segment, as readMemory reads them
+            emitAddress(op);
+            emitPhysical(op, 0);
+            emitPhysical(op, 1);
+            emit({0x48, 0xBA}); // mov rdx, imm64
+            emit64(memory.memSlots.data());
+            emit({0x0F, 0xB6, 0x04, 0x02, 0x8A, 0x24, 0x0A}); // movzx eax, byte [rdx + rax]; mov ah, [rdx + rcx]
+            emit({0x66, 0x89, 0x43, dest}); // mov [dest], ax
+            break;
+        case uop_mov_reg8_mem:
+            emitAddress(op);
+            emitPhysical(op, 0);
+            emit({0x48, 0xBA}); // mov rdx, imm64
+            emit64(memory.memSlots.data());
+            emit({0x8A, 0x04, 0x02, 0x88, 0x43, dest}); // mov al, [rdx + rax]; mov [dest], al
+            break;
+        case uop_mov_mem_reg16:
+        case uop_mov_mem_reg8:
+        case uop_mov_mem_imm16:
+        case uop_mov_mem_imm8:
+        {
+            bool wide = (op.kind == uop_mov_mem_reg16) || (op.kind == uop_mov_mem_imm16);
+            emitAddress(op);
+            if (op.kind == uop_mov_mem_reg16)
+            {
+                emit({0x0F, 0xB7, 0x53, source}); // movzx edx, word [source]
+            }
+            else if (op.kind == uop_mov_mem_reg8)
+            {
+                emit({0x0F, 0xB6, 0x53, source}); // movzx edx, byte [source]
+            }
+            else
+            {
+                emit({0xBA}); // mov edx, imm32
+                emit32(op.data);
+            }
+
+            // Stores outside the program go straight to memory, ones into it take jitWrite to drop stale code
+            int codeSize = memory.decodeCache.size();
+            emitPhysical(op, 0);
+            emit({0x3D}); // cmp eax, imm32
+            emit32(codeSize);
+            size_t lowInCode = jumpOver(0x72);
+            size_t highInCode = 0;
+            if (wide)
+            {
+                emitPhysical(op, 1);
+                emit({0x81, 0xF9}); // cmp ecx, imm32
+                emit32(codeSize);
+                highInCode = jumpOver(0x72);
+            }
+            emit({0x49, 0xBB}); // mov r11, imm64
+            emit64(memory.memSlots.data());
+            emit({0x41, 0x88, 0x14, 0x03}); // mov [r11 + rax], dl
+            if (wide)
+            {
+                emit({0xC1, 0xEA, 0x08, 0x41, 0x88, 0x14, 0x0B}); // shr edx, 8; mov [r11 + rcx], dl
+            }
+            size_t stored = jumpOver(0xEB);
+            patch(lowInCode);
+            if (wide)
+            {
+                patch(highInCode);
+            }
+            emit({0x4C, 0x89, 0xE7, 0xB9}); // mov rdi, r12; mov ecx, wide
+            emit32(wide);
+            emit({0x44, 0x8B, 0x43, segmentSlot(op.segment)}); // mov r8d, [segment base]
+            call(reinterpret_cast<const void *>(&jitWrite));
+            emitModifiedCheck(k, op);
+            patch(stored);
+            break;
+        }
+        case uop_jcc:
+        case uop_loop:
+        case uop_loopz:
+        case uop_loopnz:
+        case uop_jcxz:
+        {
+            size_t notTaken = 0;
+            size_t cxZero = 0;
+            switch (op.kind)
+            {
+            case uop_jcc:
+                if (flagsKnown)
+                {
+                    emitPackedFlags();
+                    emit({0xB9}); // mov ecx, conditionTable entry
+                    emit32(conditionTable.entries[op.condition]);
+                    emit({0x0F, 0xA3, 0xD1}); // bt ecx, edx
+                    notTaken = jumpOver(0x73);
+                    break;
+                }
+                emit({0x4C, 0x89, 0xEF}); // mov rdi, r13
+                emit({0xBE}); // mov esi, condition
+                emit32(op.condition);
+                call(reinterpret_cast<const void *>(&jitCondition));
+                emit({0x85, 0xC0}); // test eax, eax
+                notTaken = jumpOver(0x74);
+                break;
+            case uop_loop:
+                emit({0x66, 0xFF, 0xCD}); // dec bp
+                notTaken = jumpOver(0x74);
+                break;
+            case uop_jcxz:
+                emit({0x66, 0x85, 0xED}); // test bp, bp
+                notTaken = jumpOver(0x75);
+                break;
+            default: // loopz, loopnz
+                emit({0x66, 0xFF, 0xCD}); // dec bp
+                emitZeroFlagTest();
+                notTaken = jumpOver((op.kind == uop_loopnz) ? 0x75 : 0x74);
+                emit({0x66, 0x85, 0xED}); // test bp, bp
+                cxZero = jumpOver(0x74);
+                break;
+            }
+            emitExit(k + 1, block.end + op.data, 1, true);
+            patch(notTaken);
+            if (cxZero != 0)
+            {
+                patch(cxZero);
+            }
+            emitExit(k + 1, block.end, 0, true);
+            break;
+        }
+        case uop_generic:
+            flushCx();
+            emit({0x48, 0xBF}); // mov rdi, imm64
+            emit64(&memory.decodeCache[op.data]);
+            emit({0x48, 0x89, 0xDE, 0x4C, 0x89, 0xE2, 0x4C, 0x89, 0xE9}); // mov rsi, rbx; mov rdx, r12; mov rcx, r13
+            call(reinterpret_cast<const void *>(&jitEmulate));
+            reloadCx();
+            emitModifiedCheck(k, op);
+            flagsKnown = false;
+            break;
+        case uop_block_end:
+            emitExit(k, block.end, 0, true);
+            break;
+        default:
+            break;
+        }
+
+        // add/sub/cmp leave the result in eax and the source in ecx, as executeBlock computes them
+        if (isArith)
+        {
+            Mnemonic mnemonic = op.mnemonic;
+            int combine = (mnemonic == add) ? 0x01 : 0x29;
+            if (form == 2 || form == 3)
+            {
+                emit({0xB9}); // mov ecx, imm32
+                emit32(op.data);
+            }
+            else if (form == 0)
+            {
+                emit({0x0F, 0xBF, 0x4B, source}); // movsx ecx, word [source]
+            }
+            else
+            {
+                emit({0x0F, 0xB6, 0x4B, source}); // movzx ecx, byte [source]
+            }
+
+            // Byte forms store just their byte, eax then gets the word the lazy flags see (byteResult)
+            if (form == 0 || form == 2)
+            {
+                emit({0x0F, 0xBF, 0x43, dest, combine, 0xC8}); // movsx eax, word [dest]; add/sub eax, ecx
+                if (mnemonic != cmp)
+                {
+                    emit({0x66, 0x89, 0x43, dest}); // mov [dest], ax
+                }
+            }
+            else if ((dest & 1) == 0)
+            {
+                emit({0x0F, 0xB6, 0x43, dest, combine, 0xC8}); // movzx eax, byte [dest]; add/sub eax, ecx
+                if (mnemonic != cmp)
+                {
+                    emit({0x88, 0x43, dest}); // mov [dest], al
+                }
+                if (form == 1)
+                {
+                    emit({0x0F, 0xB6, 0xC0}); // movzx eax, al
+                }
+                emit({0x0F, 0xB7, 0x53, dest, 0x81, 0xE2}); // movzx edx, word [dest]; and edx, 0xFF00
+                emit32(highBitsMask);
+                emit({0x01, 0xD0}); // add eax, edx
+            }
+            else
+            {
+                emit({0x0F, 0xB7, 0x53, dest - 1, 0x81, 0xE2}); // movzx edx, word [dest word]; and edx, 0xFF00
+                emit32(highBitsMask);
+                emit({0x89, 0xC8, 0xC1, 0xE0, 0x08, combine, 0xC2}); // mov eax, ecx; shl eax, 8; add/sub edx, eax
+                if (mnemonic != cmp)
+                {
+                    emit({0x88, 0x73, dest}); // mov [dest], dh
+                }
+                emit({0x0F, 0xB6, 0x43, dest - 1, 0x01, 0xD0}); // movzx eax, byte [dest low]; add eax, edx
+            }
+
+            if (recordFlags[k] == 1)
+            {
+                emitRecord(mnemonic, op.w, false);
+            }
+            else if (recordFlags[k] == 2)
+            {
+                emit({0x41, 0x89, 0xC0, 0x41, 0x89, 0xC9}); // mov r8d, eax; mov r9d, ecx
+                recordKept = true;
+                keptMnemonic = mnemonic;
+                keptW = op.w;
+            }
+            flagsKnown = true;
+            knownMnemonic = mnemonic;
+            knownW = op.w;
+        }
+        if (touchesCx)
+        {
+            reloadCx();
+        }
+    }
+
+    // Never writable and executable at once: code goes into the read/write pages after the ones earlier
+    // bursts sealed, and sealJitBuffer makes it executable before any of it runs
+    size_t start = max(jit.used, jit.sealed);
+    if (start + code.size() > jit.capacity)
+    {
+        return nullptr;
+    }
+    u8 *entry = jit.code + start;
+    memcpy(entry, code.data(), code.size());
+    jit.used = start + code.size();
+    return reinterpret_cast<JitFunction>(entry);
+#else
+    return nullptr;
+#endif
+}
+
+void sealJitBuffer(JitBuffer &jit)
+{
+#if JIT_SUPPORTED
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t end = (jit.used + page - 1) & ~(page - 1);
+    if ((end > jit.sealed) && (mprotect(jit.code + jit.sealed, end - jit.sealed, PROT_READ | PROT_EXEC) != 0))
+    {
+        throw runtime_error("Can't make JIT code executable");
+    }
+    jit.sealed = max(jit.sealed, end);
+#endif
+}
+
+// Only called between runs, when none of the code is live any more
+void recycleJitBuffer(JitBuffer &jit)
+{
+#if JIT_SUPPORTED
+    if ((jit.sealed > 0) && (mprotect(jit.code, jit.sealed, PROT_READ | PROT_WRITE) != 0))
+    {
+        closeJitBuffer(jit);
+        openJitBuffer(jit);
+        return;
+    }
+#endif
+    jit.used = 0;
+    jit.sealed = 0;
+}
+
+void openJitBuffer(JitBuffer &jit)
+{
+#if JIT_SUPPORTED
+    size_t capacity = 16 << 20;
+    void *code = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED)
+    {
+        jit.code = static_cast<u8 *>(code);
+        jit.capacity = capacity;
+    }
+#endif
+    jit.used = 0;
+    jit.sealed = 0;
+}
+
+void closeJitBuffer(JitBuffer &jit)
+{
+#if JIT_SUPPORTED
+    if (jit.code != nullptr)
+    {
+        munmap(jit.code, jit.capacity);
+    }
+#endif
+    jit.code = nullptr;
+    jit.capacity = 0;
+    jit.used = 0;
+    jit.sealed = 0;
+}
+
+JitBuffer::~JitBuffer()
+{
+    closeJitBuffer(*this);
+}
+
+void jitTrace(const string *text)
+{
+    writeOutput(*text);
+}
+
+bool jitWrite(Memory *memory, int address, int value, int wide, u32 segmentBase)
+{
+    writeMemory(*memory, segmentBase, address, value & lowBitsMask);
+    if (wide)
+    {
+        writeMemory(*memory, segmentBase, address + 1, value >> 8);
+    }
+    return memory->codeModified;
+}
+
+bool jitEmulate(const instruction *inst1, CPU *cpu, Memory *memory, Flags *flag)
+{
+    // Exceptions can't unwind through compiled code, so park them and leave the block
+    try
+    {
+        executeCommand(*inst1, *cpu, *memory, *flag);
+    }
+    catch (...)
+    {
+        jitError = current_exception();
+        return true;
+    }
+    return memory->codeModified;
+}
+
+u16 jitReadFlags(Flags *flag)
+{
+    return readFlags(*flag);
+}
+
+int jitCondition(Flags *flag, int condition)
+{
+    return conditionHolds(condition, *flag);
+}
+
+// CF, PF, ZF, SF and OF of a FLAGS value packed into bits 0-4, the column of a conditionTable entry
+int packFlags(u16 value)
+{
+    return (value & flagCF) | ((value >> 1) & 2) | ((value >> 4) & 4) | ((value >> 4) & 8) | ((value >> 7) & 16);
+}
+
+bool conditionHolds(int condition, Flags &flag)
+{
+    return (conditionTable.entries[condition] >> packFlags(readFlags(flag))) & 1;
+}
+
+// Decides a conditional jump, loops decrement cx first
+bool branchTaken(Mnemonic mnemonic, int condition, CPU &cpu, Flags &flag)
+{
+    switch (mnemonic)
+    {
+    case loop:
+        cpu.regSlots[2] -= 1;
+        return cpu.regSlots[2] != 0;
+    case loopz:
+        cpu.regSlots[2] -= 1;
+        return testFlags(flag, flagZF) && (cpu.regSlots[2] != 0);
+    case loopnz:
+        cpu.regSlots[2] -= 1;
+        return (testFlags(flag, flagZF) == false) && (cpu.regSlots[2] != 0);
+    case jcxz:
+        return cpu.regSlots[2] == 0;
+    default:
+        return conditionHolds(condition, flag);
+    }
+}
+
+void benchmarkEngines(const char *buffer, size_t fileSize)
+{
+    const Engine engines[] = {Engine::interpreter, Engine::blocks, Engine::threaded, Engine::jit};
+    const string names[] = {"switch", "blocks", "threaded", "jit"};
+    int codeSize = min(fileSize, (size_t)65536);
+    double baseline = 0;
+
+    cout << "Engine benchmark, trace output off" << endl;
+    for (int e = 0; e < 4; e++)
+    {
+        // Repeat whole runs on fresh state until the timing is long enough to trust
+        long long runs = 0;
+        long long executed = 0;
+        double seconds = 0;
+        auto start = chrono::steady_clock::now();
+        while ((seconds < 0.5) || (runs < 3))
+        {
+            CPU cpu;
+            Flags &flag = cpu.flag;
+            Memory memory;
+            loadProgram(memory, buffer, codeSize);
+            executed += runEngine(engines[e], cpu, memory, flag, codeSize, false);
+            runs++;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+
+        double nsPerInstruction = (executed > 0) ? (seconds * 1e9 / executed) : 0;
+        if (e == 0)
+        {
+            baseline = nsPerInstruction;
+        }
+        cout << left << setw(10) << names[e]
+             << "runs: " << setw(10) << runs
+             << "instructions/run: " << setw(12) << (executed / runs)
+             << "ns/instruction: " << setw(10) << fixed << setprecision(2) << nsPerInstruction
+             << "speedup: " << ((nsPerInstruction > 0) ? (baseline / nsPerInstruction) : 0) << "x" << endl;
+    }
+}
+
+int runBenchSuite(const vector<string> &inputs, const string &resultsPath)
+{
+    vector<BenchResult> results;
+    for (const string &input : inputs)
+    {
+        InputImage image;
+        if (!openInput(input, image))
+        {
+            cout << "Error opening file " << input << endl;
+            return 1;
+        }
+        results.push_back(benchInput(input, image, min(image.size, (size_t)65536)));
+        closeInput(image);
+    }
+
+    // The listings are only a few bytes each, so throughput also runs over large generated programs
+    const size_t syntheticSizes[] = {1 << 20, 16 << 20};
+    for (size_t size : syntheticSizes)
+    {
+        InputImage image;
+        GeneratorConfig config;
+        config.size = size;
+        vector<u8> code;
+        generateProgram(config, code);
+        image.storage.assign(code.begin(), code.end());
+        image.data = image.storage.data();
+        image.size = image.storage.size();
+        results.push_back(benchInput("synthetic_" + to_string(size >> 20) + "MB", image, syntheticCodeWindow));
+    }
+
+    cout << left << setw(40) << "input" << setw(10) << "bytes" << setw(14) << "decode ns" << setw(14) << "simulate ns"
+         << setw(14) << "print ns" << "decoded MB/s" << endl;
+    for (const BenchResult &result : results)
+    {
+        cout << left << setw(40) << result.input << setw(10) << result.bytes << fixed << setprecision(2)
+             << setw(14) << result.decodeNs << setw(14) << result.simulateNs << setw(14) << result.printNs
+             << ((result.decodeNs > 0) ? (result.bytes * 1e3 / (result.decodeNs * result.decoded)) : 0);
+        if (!result.error.empty())
+        {
+            cout << "  (" << result.error << ")";
+        }
+        cout << endl;
+    }
+
+    ofstream out(resultsPath, ios::out | ios::binary);
+    if (!out)
+    {
+        cout << "Error opening output" << endl;
+        return 1;
+    }
+    writeBenchResults(out, results);
+    cout << "Results written to " << resultsPath << endl;
+    return 0;
+}
+
+BenchResult benchInput(const string &name, const InputImage &image, int codeSize)
+{
+    BenchResult result;
+    result.input = name;
+    result.bytes = image.size;
+
+    // Decoder: one linear sweep from the first byte, stopping at the first unknown opcode
+    vector<instruction> sample;
+    for (size_t pos = 0; pos < image.size; result.decoded++)
+    {
+        instruction entry;
+        decodeAt(image, pos, entry);
+        if (entry.op_tag == unknown)
+        {
+            result.error = "decode: Invalid Optag at " + to_string(pos);
+            break;
+        }
+        pos += entry.size;
+        if (sample.size() < printSampleSize)
+        {
+            sample.push_back(entry);
+        }
+    }
+    measure([&]() {
+        long long count = 0;
+        instruction command(unknown);
+        for (size_t pos = 0; count < result.decoded; count++)
+        {
+            decodeAt(image, pos, command);
+            pos += command.size;
+        }
+        return count;
+    }, result.decodeNs, result.decodeCycles);
+
+    // Simulator: fresh registers and flags per run, memory and its decode cache stay warm between runs.
+    // A program that stored into its own code gets back just the bytes it changed
+    unique_ptr<Memory> memory = make_unique<Memory>();
+    loadProgram(*memory, image.data, codeSize);
+    try
+    {
+        measure([&]() {
+            if (memory->codeModified)
+            {
+                int first = memory->modifiedFirst;
+                int last = memory->modifiedLast;
+                memcpy(memory->memSlots.data() + first, image.data + first, last - first + 1);
+                for (int k = max(0, first - maxInstructionSize + 1); k <= last; k++)
+                {
+                    memory->decodeCache[k].size = 0;
+                }
+                memory->codeModified = false;
+                memory->modifiedLast = -1;
+            }
+            CPU cpu;
+            Flags &flag = cpu.flag;
+            result.simulated = runInterpreter(cpu, *memory, flag, codeSize, false);
+            return result.simulated;
+        }, result.simulateNs, result.simulateCycles);
+    }
+    catch (const exception &failure)
+    {
+        result.error = string("simulate: ") + failure.what();
+        result.simulated = 0;
+        result.simulateNs = 0;
+        result.simulateCycles = 0;
+    }
+
+    // Printer: formats the first part of the sweep into the output buffer, flushed into a stream that discards it
+    ostream discard(nullptr);
+    outputStream = &discard;
+    measure([&]() {
+        for (const instruction &entry : sample)
+        {
+            printCommand(entry);
+        }
+        return (long long)sample.size();
+    }, result.printNs, result.printCycles);
+    flushOutput();
+    outputStream = &cout;
+    return result;
+}
+
+void measure(const function<long long()> &run, double &ns, double &cycles)
+{
+    // Repeat the whole run until the timing is long enough to trust
+    long long runs = 0;
+    long long units = 0;
+    double seconds = 0;
+    uint64_t startCycles = readCycleCounter();
+    auto start = chrono::steady_clock::now();
+    while ((seconds < benchMinSeconds) || (runs < 3))
+    {
+        units += run();
+        runs++;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if ((units == 0) && (runs >= 3))
+        {
+            break;
+        }
+    }
+    uint64_t elapsedCycles = readCycleCounter() - startCycles;
+    ns = (units > 0) ? (seconds * 1e9 / units) : 0;
+    cycles = (units > 0) ? ((double)elapsedCycles / units) : 0;
+}
+
+uint64_t readCycleCounter()
+{
+#if CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0; // no portable counter, cycles are reported as 0
+#endif
+}
+
+void writeBenchResults(ostream &out, const vector<BenchResult> &results)
+{
+    // JSON, one object per input, rates derived from the per-instruction timings
+    auto perSecond = [](double ns) { return (ns > 0) ? (1e9 / ns) : 0; };
+    auto escape = [](const string &text)
+    {
+        string escaped;
+        for (char c : text)
+        {
+            if ((c == '"') || (c == '\\'))
+            {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    };
+    out << fixed << setprecision(2) << "{\n  \"cycle_counter\": " << (CYCLE_COUNTER ? "true" : "false") << ",\n  \"results\": [";
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        const BenchResult &result = results[k];
+        double bytesPerInstruction = (result.decoded > 0) ? ((double)result.bytes / result.decoded) : 0;
+        out << ((k == 0) ? "\n" : ",\n")
+            << "    {\"input\": \"" << escape(result.input) << "\", \"bytes\": " << result.bytes
+            << ", \"error\": \"" << escape(result.error) << "\",\n"
+            << "     \"decode\": {\"instructions\": " << result.decoded
+            << ", \"ns_per_instruction\": " << result.decodeNs
+            << ", \"cycles_per_instruction\": " << result.decodeCycles
+            << ", \"instructions_per_second\": " << perSecond(result.decodeNs)
+            << ", \"bytes_per_second\": " << perSecond(result.decodeNs) * bytesPerInstruction << "},\n"
+            << "     \"simulate\": {\"instructions\": " << result.simulated
+            << ", \"ns_per_instruction\": " << result.simulateNs
+            << ", \"cycles_per_instruction\": " << result.simulateCycles
+            << ", \"instructions_per_second\": " << perSecond(result.simulateNs) << "},\n"
+            << "     \"print\": {\"instructions\": " << min((size_t)result.decoded, printSampleSize)
+            << ", \"ns_per_instruction\": " << result.printNs
+            << ", \"cycles_per_instruction\": " << result.printCycles
+            << ", \"instructions_per_second\": " << perSecond(result.printNs) << "}}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int runGenerator(const string &path, const GeneratorConfig &config)
+{
+    vector<u8> code;
+    generateProgram(config, code);
+    ofstream out(path, ios::out | ios::binary);
+    if (!out)
+    {
+        cout << "Error opening output" << endl;
+        return 1;
+    }
+    out.write(reinterpret_cast<const char *>(code.data()), code.size());
+    cout << "Wrote " << code.size() << " bytes to " << path << " (seed " << config.seed << ")" << endl;
+    return 0;
+}
+
+bool parseMix(const string &text, GeneratorConfig &config)
+{
+    // Comma separated name:weight pairs, names left out keep their weight
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+        string item = text.substr(start, end - start);
+        size_t colon = item.find(':');
+        if (colon == string::npos)
+        {
+            return false;
+        }
+        string name = item.substr(0, colon);
+        int weight = max(0, atoi(item.c_str() + colon + 1));
+        if (name == "mov")
+        {
+            config.movWeight = weight;
+        }
+        else if (name == "arith")
+        {
+            config.arithWeight = weight;
+        }
+        else if (name == "jump")
+        {
+            config.jumpWeight = weight;
+        }
+        else if (name == "loop")
+        {
+            config.loopWeight = weight;
+        }
+        else
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return (config.movWeight + config.arithWeight + config.jumpWeight + config.loopWeight) > 0;
+}
+
+void generateProgram(const GeneratorConfig &config, vector<u8> &code)
+{
+    Generator gen;
+    gen.config = config;
+    gen.config.loopDepth = min(max(config.loopDepth, 0), maxGeneratedLoopDepth);
+    gen.config.memoryDensity = min(max(config.memoryDensity, 0.0), 1.0);
+    gen.state = config.seed;
+    gen.code.reserve(config.size);
+
+    // Address registers point at the data area and are never written again
+    const u8 registers[4] = {0xBB, 0xBD, 0xBE, 0xBF}; // mov bx/bp/si/di, imm16
+    const int values[4] = {generatedBx, generatedBp, generatedSi + randomBelow(gen, 0x100), generatedDi + randomBelow(gen, 0x100)};
+    for (int k = 0; (k < 4) && (gen.code.size() + 3 <= config.size); k++)
+    {
+        gen.code.push_back(registers[k]);
+        emitData(gen, values[k], true);
+    }
+
+    while (gen.code.size() + maxGeneratedItemSize <= config.size)
+    {
+        generateItem(gen, config.size);
+    }
+    // Top up with single instructions until the next one might not fit
+    while (gen.code.size() + maxGeneratedInstructionSize <= config.size)
+    {
+        generateInstruction(gen);
+    }
+    code.swap(gen.code);
+}
+
+void generateItem(Generator &gen, size_t limit)
+{
+    const GeneratorConfig &config = gen.config;
+    int total = config.movWeight + config.arithWeight + config.jumpWeight + config.loopWeight;
+    int pick = randomBelow(gen, total);
+    if (pick < config.movWeight)
+    {
+        generateMov(gen);
+    }
+    else if (pick < config.movWeight + config.arithWeight)
+    {
+        generateArith(gen);
+    }
+    else if ((pick < total - config.loopWeight) && (gen.code.size() + maxGeneratedItemSize <= limit))
+    {
+        generateSkip(gen);
+    }
+    else if ((gen.depth < config.loopDepth) && (gen.reserved != 0b10110) && (gen.code.size() + minGeneratedLoopSize <= limit))
+    {
+        generateLoop(gen, limit);
+    }
+    else
+    {
+        generateInstruction(gen);
+    }
+}
+
+void generateInstruction(Generator &gen)
+{
+    if (randomBelow(gen, gen.config.movWeight + gen.config.arithWeight + 1) <= gen.config.movWeight)
+    {
+        generateMov(gen);
+    }
+    else
+    {
+        generateArith(gen);
+    }
+}
+
+void generateMov(Generator &gen)
+{
+    bool memory = randomChance(gen, gen.config.memoryDensity);
+    int w = randomBelow(gen, 2);
+    int form = randomBelow(gen, 4);
+    if (form == 2)
+    {
+        form = memory ? 4 : 2; // accumulator moves always address memory, immediate_to_register never does
+    }
+    switch (form)
+    {
+    case 0: // register_mem_to_from_register
+    {
+        int d = randomBelow(gen, 2);
+        gen.code.push_back(0x88 | (d << 1) | w);
+        if (d == 1)
+        {
+            emitRM(gen, pickWritable(gen, w), memory, w, false);
+        }
+        else
         {
-        case Word:
-            return 3;
-            break;
-        case Byte:
-            return 2;
-            break;
+            emitRM(gen, randomBelow(gen, 8), memory, w, true);
         }
         break;
-    case register_mem_to_from_seg_register:
-        switch (inst1.reg_mem_to_from_seg_reg.mod)
+    }
+    case 1: // immediate_to_register_mem
+        gen.code.push_back(0xC6 | w);
+        emitRM(gen, 0, memory, w, true);
+        emitData(gen, randomBelow(gen, 0x10000), w == 1);
+        break;
+    case 2: // immediate_to_register
+        gen.code.push_back(0xB0 | (w << 3) | pickWritable(gen, w));
+        emitData(gen, randomBelow(gen, 0x10000), w == 1);
+        break;
+    case 3: // register_mem_to_from_seg_register, only es is written so later segment addressing stays put
+        if (randomBelow(gen, 2) == 0)
         {
-        case memory_mode:
-            if (inst1.reg_mem_to_from_seg_reg.rm != RM::direct_address)
-            {
-                return 2;
-            }
-            else
-            {
-                return 4;
-            }
-            break;
-        case register_mode:
-            return 2;
-            break;
-        case memory_mode_8_bit:
-            return 3;
-            break;
-        case memory_mode_16_bit:
-            return 4;
-            break;
+            gen.code.push_back(0x8E);
+            emitRM(gen, 0, memory, 1, false);
+        }
+        else
+        {
+            gen.code.push_back(0x8C);
+            emitRM(gen, randomBelow(gen, 4), memory, 1, true);
         }
         break;
-    case conditional_jump:
-        return 2;
+    default: // memory_to_acc_or_vv
+        gen.code.push_back(0xA0 | (randomBelow(gen, 2) << 1) | w);
+        emitData(gen, generatedDirect + randomBelow(gen, generatedDirectSize), true);
         break;
     }
-    cout << "Invalid Optag" << endl;
-    exit(1);
 }
 
-void getSourceAndDest(instruction &inst1)
+void generateArith(Generator &gen)
 {
-    switch (inst1.op_tag)
+    // reg field of the 0x80-0x83 group, also bits 3-5 of the other opcodes: add, sub, cmp
+    const int groups[3] = {0, 5, 7};
+    int group = groups[randomBelow(gen, 3)];
+    bool writes = (group != 7);
+    bool memory = randomChance(gen, gen.config.memoryDensity);
+    int w = randomBelow(gen, 2);
+    int form = randomBelow(gen, memory ? 2 : 3);
+    switch (form)
     {
-    case register_mem_to_from_register:
-        if (inst1.reg_mem_to_from_reg.d == register_is_source)
+    case 0: // register_mem_to_from_register
+    {
+        int d = randomBelow(gen, 2);
+        gen.code.push_back((group << 3) | (d << 1) | w);
+        if (d == 1)
         {
-            inst1.reg_mem_to_from_reg.source = inst1.reg_mem_to_from_reg.reg;
-            inst1.reg_mem_to_from_reg.dest = inst1.reg_mem_to_from_reg.rm;
+            emitRM(gen, writes ? pickWritable(gen, w) : randomBelow(gen, 8), memory, w, false);
         }
-        else if (inst1.reg_mem_to_from_reg.d == register_is_destination)
+        else
         {
-            inst1.reg_mem_to_from_reg.source = inst1.reg_mem_to_from_reg.rm;
-            inst1.reg_mem_to_from_reg.dest = inst1.reg_mem_to_from_reg.reg;
+            emitRM(gen, randomBelow(gen, 8), memory, w, writes);
         }
         break;
-    case immediate_to_register:
-        inst1.imm_to_reg.source = inst1.imm_to_reg.data;
-        inst1.imm_to_reg.dest = inst1.imm_to_reg.reg;
+    }
+    case 1: // immediate_to_register_mem, 0x82 and 0x83 carry a sign-extended byte
+    {
+        int s = randomBelow(gen, 2);
+        gen.code.push_back(0x80 | (s << 1) | w);
+        emitRM(gen, group, memory, w, writes);
+        emitData(gen, randomBelow(gen, 0x10000), (s == 0) && (w == 1));
         break;
-    case immediate_to_register_mem:
-        inst1.imm_to_reg_mem.source = inst1.imm_to_reg_mem.data;
-        inst1.imm_to_reg_mem.dest = inst1.imm_to_reg_mem.rm;
+    }
+    default: // immediate to accumulator
+        gen.code.push_back((group << 3) | 0b100 | w);
+        emitData(gen, randomBelow(gen, 0x10000), w == 1);
         break;
-    case memory_to_acc_or_vv:
-        inst1.mem_to_acc.operandTwo = inst1.mem_to_acc.address;
-        inst1.mem_to_acc.operandOne = RM::ax;
+    }
+}
 
-        break;
-    case register_mem_to_from_seg_register:
-        inst1.reg_mem_to_from_seg_reg.operandOne = inst1.reg_mem_to_from_seg_reg.rm;
-        inst1.reg_mem_to_from_seg_reg.operandTwo = inst1.reg_mem_to_from_seg_reg.sr;
-        break;
-    case conditional_jump:
-    default:
-        break;
+void generateSkip(Generator &gen)
+{
+    // Any Jcc or jcxz, jumping forward over up to three instructions so every path reaches the end
+    int condition = randomBelow(gen, 17);
+    gen.code.push_back((condition < 16) ? (0x70 + condition) : 0xE3);
+    gen.code.push_back(0);
+    size_t start = gen.code.size();
+    int count = randomBelow(gen, 4);
+    for (int k = 0; k < count; k++)
+    {
+        generateInstruction(gen);
     }
+    gen.code[start - 1] = gen.code.size() - start;
 }
 
-void printCommand(instruction &inst1, DispFlag d)
+void generateLoop(Generator &gen, size_t limit)
 {
-    string source, dest;
-    switch (inst1.op_tag)
+    // Counter in a free register, cx for loop/loopz/loopnz, otherwise decremented and tested with jne
+    const int counters[3] = {1, 2, 4}; // cx, dx, sp
+    int counter;
+    do
     {
-    case register_mem_to_from_register:
-        if (inst1.reg_mem_to_from_reg.d == register_is_source)
-        {
-            source = enumRMToString(inst1.reg_mem_to_from_reg.reg, inst1.reg_mem_to_from_reg.disp);
-            if ((d == DispFlag::Has_Displacement) && (inst1.reg_mem_to_from_reg.disp != 0))
-            {
-                dest = " " + enumRMToString(inst1.reg_mem_to_from_reg.rm, inst1.reg_mem_to_from_reg.disp) + " " + to_string(inst1.reg_mem_to_from_reg.disp);
-            }
-            else
-            {
-                dest = " " + enumRMToString(inst1.reg_mem_to_from_reg.rm, inst1.reg_mem_to_from_reg.disp);
-            }
-        }
-        else if (inst1.reg_mem_to_from_reg.d == register_is_destination)
-        {
-            if ((d == DispFlag::Has_Displacement) && (inst1.reg_mem_to_from_reg.disp != 0))
-            {
-                source = enumRMToString(inst1.reg_mem_to_from_reg.rm, inst1.reg_mem_to_from_reg.disp) + " " + to_string(inst1.reg_mem_to_from_reg.disp);
-            }
-            else
-            {
-                source = enumRMToString(inst1.reg_mem_to_from_reg.rm, inst1.reg_mem_to_from_reg.disp);
-            }
+        counter = counters[randomBelow(gen, 3)];
+    } while (gen.reserved & (1 << counter));
 
-            dest = " " + enumRMToString(inst1.reg_mem_to_from_reg.reg, inst1.reg_mem_to_from_reg.disp);
-        }
-        break;
-    case immediate_to_register:
-        source = to_string(inst1.imm_to_reg.data);
-        dest = " " + enumRMToString(inst1.imm_to_reg.reg, 0);
-        break;
-    case immediate_to_register_mem:
-        source = to_string(inst1.imm_to_reg_mem.data);
-        if ((d == DispFlag::Has_Displacement) && (inst1.imm_to_reg_mem.disp != 0))
-        {
-            dest = " " + enumRMToString(inst1.imm_to_reg_mem.rm, inst1.imm_to_reg_mem.disp) + " " + to_string(inst1.imm_to_reg_mem.disp);
-        }
-        else
-        {
-            dest = " " + enumRMToString(inst1.imm_to_reg_mem.rm, inst1.imm_to_reg_mem.disp);
-        }
+    int edge = (counter == 1) ? randomBelow(gen, 4) : 3; // 0 loopnz, 1 loopz, 2 loop, 3 sub + jne
+    size_t edgeSize = (edge == 3) ? 5 : 2;
+    gen.code.push_back(0xB8 | counter);
+    emitData(gen, 2 + randomBelow(gen, 5), true);
 
-        break;
-    case memory_to_acc_or_vv:
-        if (inst1.mem_to_acc.d == accumulator_is_destination)
-        {
-            source = to_string(inst1.mem_to_acc.address);
-            dest = " ax";
-        }
-        else if (inst1.mem_to_acc.d == accumulator_is_source)
-        {
-            source = "ax";
-            dest = " " + to_string(inst1.mem_to_acc.address);
-        }
-        break;
-    case register_mem_to_from_seg_register:
-        if (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_destination)
-        {
-            if ((d == DispFlag::Has_Displacement) && (inst1.reg_mem_to_from_seg_reg.disp != 0))
-            {
-                source = enumRMToString(inst1.reg_mem_to_from_seg_reg.rm, inst1.reg_mem_to_from_seg_reg.disp) + " " + to_string(inst1.reg_mem_to_from_seg_reg.disp);
-            }
-            else
-            {
-                source = enumRMToString(inst1.reg_mem_to_from_seg_reg.rm, inst1.reg_mem_to_from_seg_reg.disp);
-            }
+    // The back edge is a rel8, so the body stays within 128 bytes of the top
+    size_t top = gen.code.size();
+    size_t end = min(limit, top + 128) - edgeSize;
+    size_t bodyEnd = top + 8 + randomBelow(gen, end - top - 7);
+    gen.reserved |= 1 << counter;
+    gen.depth++;
+    while (gen.code.size() + maxGeneratedItemSize <= bodyEnd)
+    {
+        generateItem(gen, end);
+    }
+    while (gen.code.size() + maxGeneratedInstructionSize <= bodyEnd)
+    {
+        generateInstruction(gen);
+    }
+    gen.depth--;
+    gen.reserved &= ~(1 << counter);
 
-            dest = " " + enumSRToString(inst1.reg_mem_to_from_seg_reg.sr);
-        }
-        else if (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_source)
+    if (edge == 3)
+    {
+        gen.code.push_back(0x83);
+        gen.code.push_back(0xE8 | counter); // sub counter, 1
+        gen.code.push_back(1);
+        gen.code.push_back(0x75);
+    }
+    else
+    {
+        gen.code.push_back(0xE0 + edge);
+    }
+    gen.code.push_back((u8)(top - (gen.code.size() + 1)));
+}
+
+void emitRM(Generator &gen, int reg, bool memory, int w, bool destination)
+{
+    if (!memory)
+    {
+        int rm = destination ? pickWritable(gen, w) : randomBelow(gen, 8);
+        gen.code.push_back(0b11000000 | (reg << 3) | rm);
+        return;
+    }
+
+    // Any mod and rm, the address registers keep it in the data area above the code
+    int mod = randomBelow(gen, 3);
+    int rm = randomBelow(gen, 8);
+    gen.code.push_back((mod << 6) | (reg << 3) | rm);
+    if ((mod == 0) && (rm == 0b110))
+    {
+        emitData(gen, generatedDirect + randomBelow(gen, generatedDirectSize), true);
+    }
+    else if (mod == 1)
+    {
+        emitData(gen, randomBelow(gen, 0x100), false);
+    }
+    else if (mod == 2)
+    {
+        emitData(gen, randomBelow(gen, generatedDispRange), true);
+    }
+}
+
+void emitData(Generator &gen, int value, bool wide)
+{
+    gen.code.push_back(value & lowBitsMask);
+    if (wide)
+    {
+        gen.code.push_back((value >> 8) & lowBitsMask);
+    }
+}
+
+int pickWritable(Generator &gen, int w)
+{
+    // ax always, cx, dx and sp while no loop counts with them, never the address registers
+    int choices[4];
+    int count = 0;
+    const int candidates[4] = {0, 1, 2, 4};
+    for (int reg : candidates)
+    {
+        if (((gen.reserved & (1 << reg)) == 0) && ((w == 1) || (reg < 4)))
         {
-            source = enumSRToString(inst1.reg_mem_to_from_seg_reg.sr);
-            if ((d == DispFlag::Has_Displacement) && (inst1.reg_mem_to_from_seg_reg.disp != 0))
-            {
-                dest = " " + enumRMToString(inst1.reg_mem_to_from_seg_reg.rm, inst1.reg_mem_to_from_seg_reg.disp) + " " + to_string(inst1.reg_mem_to_from_seg_reg.disp);
-            }
-            else
-            {
-                dest = " " + enumRMToString(inst1.reg_mem_to_from_seg_reg.rm, inst1.reg_mem_to_from_seg_reg.disp);
-            }
+            choices[count++] = reg;
         }
-        break;
-    case conditional_jump:
-        source = to_string(inst1.cond_jmp.data);
-        dest = "";
-        break;
     }
-    cout << enumMnemonicToString(inst1.mnemonic) << dest << ", " << source << endl;
+    int reg = choices[randomBelow(gen, count)];
+    if ((w == 0) && (randomBelow(gen, 2) == 1))
+    {
+        reg += 4; // high byte of the same register
+    }
+    return reg;
+}
+
+int randomBelow(Generator &gen, int bound)
+{
+    return (int)(nextRandom(gen.state) % (uint64_t)bound);
 }
 
-void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
+bool randomChance(Generator &gen, double probability)
 {
-    Lo_Hi_Byte levelSource = neither;
-    Lo_Hi_Byte levelDest = neither;
+    return (nextRandom(gen.state) >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+uint64_t nextRandom(uint64_t &state)
+{
+    // splitmix64, the same sequence on every platform for a given seed
+    state += 0x9E3779B97F4A7C15ull;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void emulateCommand(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag)
+{
+    u8 *bytes = regBytes(cpu);
     i16 source = 0;
     i16 destination = 0;
     i32 result = 0;
     int destCalc = 0;
+    u32 segmentBase = cpu.segmentBase[inst1.segment - 8];
     switch (inst1.mnemonic)
     {
     case mov:
@@ -1498,142 +5346,82 @@ void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
         case immediate_to_register:
             if (inst1.w == Word)
             {
-                cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = inst1.imm_to_reg.data;
+                cpu.regSlots[inst1.imm_to_reg.dest >> 1] = inst1.imm_to_reg.data;
             }
             else
             {
-                destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)];
-                source = (inst1.imm_to_reg.data & lowBitsMask);
-                if (levelDest == low_byte)
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & highBitsMask) + source;
-                }
-                else
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & lowBitsMask) + (source << 8);
-                }
+                bytes[inst1.imm_to_reg.dest] = inst1.imm_to_reg.data;
             }
             break;
         case immediate_to_register_mem:
-            source = inst1.imm_to_reg_mem.source;
             switch (inst1.imm_to_reg_mem.mod)
             {
             case memory_mode:
             case memory_mode_8_bit:
             case memory_mode_16_bit:
-                destCalc = getCPUMem(inst1, inst1.imm_to_reg_mem.dest, cpu);
+                destCalc = getCPUMem(inst1, cpu);
                 if (inst1.w == Word)
                 {
-                    memory.memSlots[destCalc] = (inst1.imm_to_reg_mem.data & lowBitsMask);
-                    memory.memSlots[destCalc + 1] = (inst1.imm_to_reg_mem.data & highBitsMask);
+                    writeMemory(memory, segmentBase, destCalc, inst1.imm_to_reg_mem.data & lowBitsMask);
+                    writeMemory(memory, segmentBase, destCalc + 1, inst1.imm_to_reg_mem.data >> 8);
                 }
                 else
                 {
-                    memory.memSlots[destCalc] = inst1.imm_to_reg_mem.data;
+                    writeMemory(memory, segmentBase, destCalc, inst1.imm_to_reg_mem.data);
                 }
                 break;
             case register_mode:
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = inst1.imm_to_reg_mem.data;
+                    cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1] = inst1.imm_to_reg_mem.data;
                 }
                 else
                 {
-                    destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)];
-                    source = inst1.imm_to_reg_mem.data;
-                    if (levelDest == low_byte)
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = (destination & highBitsMask) + source;
-                    }
-                    else
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = (destination & lowBitsMask) + (source << 8);
-                    }
+                    bytes[inst1.imm_to_reg_mem.dest] = inst1.imm_to_reg_mem.data;
                 }
                 break;
             }
             break;
         case register_mem_to_from_register:
-            if (inst1.reg_mem_to_from_reg.d == register_is_source)
-            {
-                source = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-                if (inst1.reg_mem_to_from_reg.mod != register_mode)
-                {
-                    destCalc = getCPUMem(inst1, inst1.reg_mem_to_from_reg.dest, cpu);
-                }
-            }
-            else
-            {
-                source = getCPUMem(inst1, inst1.reg_mem_to_from_reg.source, cpu);
-                if (inst1.reg_mem_to_from_reg.mod != register_mode)
-                {
-                destination = getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest);
-                }
-            }
             switch (inst1.reg_mem_to_from_reg.mod)
             {
             case memory_mode:
             case memory_mode_8_bit:
             case memory_mode_16_bit:
+                destCalc = getCPUMem(inst1, cpu);
                 if (inst1.reg_mem_to_from_reg.d == register_is_source)
                 {
                     if (inst1.w == Word)
                     {
-                        memory.memSlots[destCalc] = (source & lowBitsMask);
-                        memory.memSlots[destCalc + 1] = (source & highBitsMask);
+                        source = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
+                        writeMemory(memory, segmentBase, destCalc, source & lowBitsMask);
+                        writeMemory(memory, segmentBase, destCalc + 1, source >> 8);
                     }
                     else
                     {
-                        memory.memSlots[destCalc] = source;
+                        writeMemory(memory, segmentBase, destCalc, bytes[inst1.reg_mem_to_from_reg.source]);
                     }
                 }
                 else
                 {
                     if (inst1.w == Word)
                     {
-                        cpu.regSlots[destination] = (memory.memSlots[source + 1] & highBitsMask) + (memory.memSlots[source] & lowBitsMask);
+                        cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1] = (readMemory(memory, segmentBase, destCalc + 1) << 8) + (readMemory(memory, segmentBase, destCalc) & lowBitsMask);
                     }
                     else
                     {
-                        cpu.regSlots[destination] = memory.memSlots[source];
+                        bytes[inst1.reg_mem_to_from_reg.dest] = readMemory(memory, segmentBase, destCalc);
                     }
                 }
                 break;
             case register_mode:
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelSource)] = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
+                    cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1] = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
                 }
                 else
                 {
-                    source = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-                    destination = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)];
-                    i16 tempSource = -1;
-                    i16 tempDest = -1;
-                    if (levelSource == low_byte)
-                    {
-                        tempSource = source & lowBitsMask;
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + tempSource;
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + (tempSource << 8);
-                        }
-                    }
-                    else if (levelSource == high_byte)
-                    {
-                        tempSource = ((source & highBitsMask) >> 8);
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + tempSource;
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + (tempSource << 8);
-                        }
-                    }
+                    bytes[inst1.reg_mem_to_from_reg.dest] = bytes[inst1.reg_mem_to_from_reg.source];
                 }
                 break;
             }
@@ -1641,141 +5429,128 @@ void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
         case register_mem_to_from_seg_register:
             switch (inst1.reg_mem_to_from_seg_reg.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                destCalc = getCPUMem(inst1, cpu);
+                if (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_destination)
+                {
+                    setSegment(cpu, getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo), (readMemory(memory, segmentBase, destCalc + 1) << 8) + (readMemory(memory, segmentBase, destCalc) & lowBitsMask));
+                }
+                else
+                {
+                    source = cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)];
+                    writeMemory(memory, segmentBase, destCalc, source & lowBitsMask);
+                    writeMemory(memory, segmentBase, destCalc + 1, source >> 8);
+                }
                 break;
             case register_mode:
                 if (inst1.reg_mem_to_from_seg_reg.d == segment_register_is_destination)
                 {
-                    cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)] = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_seg_reg.operandOne, levelSource)];
+                    setSegment(cpu, getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo), cpu.regSlots[inst1.reg_mem_to_from_seg_reg.operandOne >> 1]);
                 }
                 else
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_seg_reg.operandOne, levelSource)] = cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)];
+                    cpu.regSlots[inst1.reg_mem_to_from_seg_reg.operandOne >> 1] = cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)];
                 }
                 break;
             }
             break;
-        case memory_to_acc_or_vv: // Not yet coded
+        case memory_to_acc_or_vv:
+            destCalc = getCPUMem(inst1, cpu);
+            if (inst1.mem_to_acc.d == accumulator_is_source)
+            {
+                writeMemory(memory, segmentBase, destCalc, cpu.regSlots[0] & lowBitsMask);
+                if (inst1.w == Word)
+                {
+                    writeMemory(memory, segmentBase, destCalc + 1, cpu.regSlots[0] >> 8);
+                }
+            }
+            else if (inst1.w == Word)
+            {
+                cpu.regSlots[0] = (readMemory(memory, segmentBase, destCalc + 1) << 8) + (readMemory(memory, segmentBase, destCalc) & lowBitsMask);
+            }
+            else
+            {
+                bytes[0] = readMemory(memory, segmentBase, destCalc);
+            }
             break;
+        default:
+            throw runtime_error("Invalid Optag");
         }
         break;
     case add:
         switch (inst1.op_tag)
         {
         case register_mem_to_from_register:
-            source = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-            destination = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)];
             switch (inst1.reg_mem_to_from_reg.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
+                destination = cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1];
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelSource)] += cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-                    result = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelSource)] + cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
+                    source = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
+                    cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1] += source;
+                    result = destination + source;
                 }
                 else
                 {
-                    if (levelSource == low_byte)
-                    {
-                        source = source & lowBitsMask;
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + ((source + (destination & lowBitsMask)) & lowBitsMask);
-                            result = (destination & highBitsMask) + ((source + (destination & lowBitsMask)) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                        }
-                    }
-                    else if (levelSource == high_byte)
-                    {
-                        source = ((source & highBitsMask) >> 8);
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + (((destination & lowBitsMask) + source) & lowBitsMask);
-                            result = (destination & highBitsMask) + (((destination & lowBitsMask) + source) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                        }
-                    }
+                    source = bytes[inst1.reg_mem_to_from_reg.source];
+                    bytes[inst1.reg_mem_to_from_reg.dest] += source;
+                    result = byteResult(add, destination, inst1.reg_mem_to_from_reg.dest, source, true);
                 }
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
-            setFlags(inst1, result, source, flag);
             break;
         case immediate_to_register_mem:
             switch (inst1.imm_to_reg_mem.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
-                destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)];
+                destination = cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1];
                 source = inst1.imm_to_reg_mem.data;
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] += source;
+                    cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1] += source;
                     result = destination + source;
                 }
                 else
                 {
-                    if (levelDest == low_byte)
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = ((destination & highBitsMask) + (source + (destination & lowBitsMask)));
-                        result = ((destination & highBitsMask) + (source + (destination & lowBitsMask)));
-                    }
-                    else
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                        result = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                    }
+                    bytes[inst1.imm_to_reg_mem.dest] += source;
+                    result = byteResult(add, destination, inst1.imm_to_reg_mem.dest, source, false);
                 }
-                setFlags(inst1, result, source, flag);
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
             break;
         case immediate_to_register:
-            destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)];
-            source = inst1.imm_to_reg.data;
+            destination = cpu.regSlots[inst1.imm_to_reg.dest >> 1];
             if (inst1.w == Word)
             {
-                cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] += inst1.imm_to_reg.data;
-                result = destination + inst1.imm_to_reg.data;
+                source = inst1.imm_to_reg.data;
+                cpu.regSlots[inst1.imm_to_reg.dest >> 1] += source;
+                result = destination + source;
             }
             else
             {
                 source = (inst1.imm_to_reg.data & lowBitsMask);
-                if (levelDest == low_byte)
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & highBitsMask) + ((destination & lowBitsMask) + source);
-                    result = (destination & highBitsMask) + ((destination & lowBitsMask) + source);
-                }
-                else
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                    result = (destination & lowBitsMask) + ((destination & highBitsMask) + (source << 8));
-                }
+                bytes[inst1.imm_to_reg.dest] += source;
+                result = byteResult(add, destination, inst1.imm_to_reg.dest, source, false);
             }
-            setFlags(inst1, result, source, flag);
+            setFlags(inst1.mnemonic, inst1.w, result, source, flag);
             break;
+        default:
+            throw runtime_error("Invalid Optag");
         }
         break;
     case sub:
@@ -1784,113 +5559,72 @@ void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
         case register_mem_to_from_register:
             switch (inst1.reg_mem_to_from_reg.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
-                source = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-                destination = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)];
+                destination = cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1];
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelSource)] -= source;
+                    source = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
+                    cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1] -= source;
                     result = destination - source;
                 }
                 else
                 {
-                    if (levelSource == low_byte)
-                    {
-                        source = source & lowBitsMask;
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                            result = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                        }
-                    }
-                    else if (levelSource == high_byte)
-                    {
-                        source = ((source & highBitsMask) >> 8);
-                        if (levelDest == low_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                            result = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                        }
-                    }
+                    source = bytes[inst1.reg_mem_to_from_reg.source];
+                    bytes[inst1.reg_mem_to_from_reg.dest] -= source;
+                    result = byteResult(sub, destination, inst1.reg_mem_to_from_reg.dest, source, true);
                 }
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
-            setFlags(inst1, result, source, flag);
             break;
         case immediate_to_register_mem:
             switch (inst1.imm_to_reg_mem.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
-                destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)];
+                destination = cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1];
                 source = inst1.imm_to_reg_mem.data;
                 if (inst1.w == Word)
                 {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] -= source;
+                    cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1] -= source;
                     result = destination - source;
                 }
                 else
                 {
-                    if (levelDest == low_byte)
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = ((destination & highBitsMask) + ((destination & lowBitsMask) - source));
-                        result = ((destination & highBitsMask) + ((destination & lowBitsMask) - source));
-                    }
-                    else
-                    {
-                        cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                        result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                    }
+                    bytes[inst1.imm_to_reg_mem.dest] -= source;
+                    result = byteResult(sub, destination, inst1.imm_to_reg_mem.dest, source, false);
                 }
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
-            setFlags(inst1, result, source, flag);
             break;
         case immediate_to_register:
-            destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)];
-            source = inst1.imm_to_reg.data;
+            destination = cpu.regSlots[inst1.imm_to_reg.dest >> 1];
             if (inst1.w == Word)
             {
-                cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] -= inst1.imm_to_reg.data;
-                result = destination - inst1.imm_to_reg.data;
+                source = inst1.imm_to_reg.data;
+                cpu.regSlots[inst1.imm_to_reg.dest >> 1] -= source;
+                result = destination - source;
             }
             else
             {
                 source = (inst1.imm_to_reg.data & lowBitsMask);
-                if (levelDest == low_byte)
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & highBitsMask) + ((destination & lowBitsMask) - source);
-                    result = (destination & highBitsMask) + ((destination & lowBitsMask) - source);
-                }
-                else
-                {
-                    cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)] = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                    result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                }
+                bytes[inst1.imm_to_reg.dest] -= source;
+                result = byteResult(sub, destination, inst1.imm_to_reg.dest, source, false);
             }
-            setFlags(inst1, result, source, flag);
+            setFlags(inst1.mnemonic, inst1.w, result, source, flag);
             break;
+        default:
+            throw runtime_error("Invalid Optag");
         }
         break;
     case cmp:
@@ -1899,82 +5633,52 @@ void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
         case register_mem_to_from_register:
             switch (inst1.reg_mem_to_from_reg.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
-                source = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
-                destination = cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, levelDest)];
+                destination = cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1];
                 if (inst1.w == Word)
                 {
-                    result = destination - cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.source, levelSource)];
+                    source = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
+                    result = destination - source;
                 }
                 else
                 {
-                    if (levelSource == low_byte)
-                    {
-                        source = source & lowBitsMask;
-                        if (levelDest == low_byte)
-                        {
-                            result = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                        }
-                    }
-                    else if (levelSource == high_byte)
-                    {
-                        source = ((source & highBitsMask) >> 8);
-                        if (levelDest == low_byte)
-                        {
-                            result = (destination & highBitsMask) + (((destination & lowBitsMask) - source) & lowBitsMask);
-                        }
-                        else if (levelDest == high_byte)
-                        {
-                            result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                        }
-                    }
+                    source = bytes[inst1.reg_mem_to_from_reg.source];
+                    result = byteResult(cmp, destination, inst1.reg_mem_to_from_reg.dest, source, true);
                 }
-                setFlags(inst1, result, source, flag);
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
+            break;
         case immediate_to_register_mem:
             switch (inst1.imm_to_reg_mem.mod)
             {
-            case memory_mode: // Not yet coded
-                break;
-            case memory_mode_8_bit: // Not yet coded
-                break;
-            case memory_mode_16_bit: // Not yet coded
+            case memory_mode:
+            case memory_mode_8_bit:
+            case memory_mode_16_bit:
+                emulateMemoryArith(inst1, cpu, memory, flag);
                 break;
             case register_mode:
-                destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, levelDest)];
+                destination = cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1];
                 source = inst1.imm_to_reg_mem.data;
                 if (inst1.w == Word)
                 {
-                    result = destination - inst1.imm_to_reg_mem.data;
+                    result = destination - source;
                 }
                 else
                 {
-                    if (levelDest == low_byte)
-                    {
-                        result = ((destination & highBitsMask) + ((destination & lowBitsMask) - source));
-                    }
-                    else
-                    {
-                        result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                    }
+                    result = byteResult(cmp, destination, inst1.imm_to_reg_mem.dest, source, false);
                 }
-                setFlags(inst1, result, source, flag);
+                setFlags(inst1.mnemonic, inst1.w, result, source, flag);
                 break;
             }
             break;
         case immediate_to_register:
-            destination = cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, levelDest)];
+            destination = cpu.regSlots[inst1.imm_to_reg.dest >> 1];
             source = (inst1.imm_to_reg.data & lowBitsMask);
             if (inst1.w == Word)
             {
@@ -1982,580 +5686,415 @@ void emulateCommand(instruction inst1, CPU &cpu, Memory &memory, Flags &flag)
             }
             else
             {
-                if (levelDest == low_byte)
-                {
-                    result = (destination & highBitsMask) + ((destination & lowBitsMask) - source);
-                }
-                else
-                {
-                    result = (destination & lowBitsMask) + ((destination & highBitsMask) - (source << 8));
-                }
+                result = byteResult(cmp, destination, inst1.imm_to_reg.dest, source, false);
             }
-            setFlags(inst1, result, source, flag);
+            setFlags(inst1.mnemonic, inst1.w, result, source, flag);
             break;
+        default:
+            throw runtime_error("Invalid Optag");
         }
         break;
-    case jb:
-        if (flag.flags[15])
-        {
-            cpu.regSlots[12] += inst1.cond_jmp.data;
-        }
-        break;
-    case je:
-        if (flag.flags[9])
-        {
-            cpu.regSlots[12] += inst1.cond_jmp.data;
-        }
-        break;
-    case jne:
-        if (flag.flags[9] == false)
-        {
-            cpu.regSlots[12] += inst1.cond_jmp.data;
-        }
-        break;
-    case jp:
-        if (flag.flags[13])
-        {
-            cpu.regSlots[12] += inst1.cond_jmp.data;
-        }
-        break;
-    case loopnz:
-        cpu.regSlots[2] -= 1;
-        if ((flag.flags[9] == false) && (cpu.regSlots[2] != 0))
-        {
-            cpu.regSlots[12] += inst1.cond_jmp.data;
-        }
-        break;
-    case loopz:
-        cpu.regSlots[2] -= 1;
-        if ((flag.flags[9] == true) && (cpu.regSlots[2] != 0))
+    default: // Conditional jumps, loops and jcxz
+        if ((inst1.op_tag == conditional_jump) && branchTaken(inst1.mnemonic, inst1.cond_jmp.condition, cpu, flag))
         {
             cpu.regSlots[12] += inst1.cond_jmp.data;
         }
         break;
-    default: // Other commands not yet emulated
-        break;
     }
 }
 
-void printOperation(instruction inst1, CPU cpu)
+// add/sub/cmp with a memory operand. The memory value is the destination unless the register is,
+// and only add and sub with a memory destination store back
+void emulateMemoryArith(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag)
 {
-    Lo_Hi_Byte junk = neither;
-    switch (inst1.op_tag)
+    u8 *bytes = regBytes(cpu);
+    u32 segmentBase = cpu.segmentBase[inst1.segment - 8];
+    int address = getCPUMem(inst1, cpu);
+    i16 value = 0;
+    i16 source = 0;
+    i32 result = 0;
+    if (inst1.w == Word)
     {
-    case immediate_to_register:
-        cout << regList[getCPUSlotRM(inst1.imm_to_reg.dest, junk)] << " new value is: " << cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg.dest, junk)] << endl;
-        break;
-    case immediate_to_register_mem:
-        cout << regList[getCPUSlotRM(inst1.imm_to_reg_mem.dest, junk)] << " new value is: " << cpu.regSlots[getCPUSlotRM(inst1.imm_to_reg_mem.dest, junk)] << endl;
-        break;
-    case register_mem_to_from_register:
-        cout << regList[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, junk)] << " new value is: " << cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_reg.dest, junk)] << endl;
-        break;
-    case register_mem_to_from_seg_register:
-        if (inst1.reg_mem_to_from_seg_reg.d == Direction::segment_register_is_destination)
-        {
-            cout << regList[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)] << " new value is: " << cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)] << endl;
-        }
-        else
-        {
-            cout << regList[getCPUSlotRM(inst1.reg_mem_to_from_seg_reg.operandOne, junk)] << " new value is: " << cpu.regSlots[getCPUSlotRM(inst1.reg_mem_to_from_seg_reg.operandOne, junk)] << endl;
-        }
-        break;
-    case memory_to_acc_or_vv:
-        if (inst1.mem_to_acc.d == Direction::accumulator_is_destination)
-        {
-            cout << regList[getCPUSlotRM(inst1.mem_to_acc.operandOne, junk)] << " new value is: " << cpu.regSlots[getCPUSlotRM(inst1.mem_to_acc.operandOne, junk)] << endl;
-        }
-        else
-        {
-            cout << "Not yet coded - ERROR" << endl;
-        }
-        break;
+        value = (readMemory(memory, segmentBase, address + 1) << 8) + (readMemory(memory, segmentBase, address) & lowBitsMask);
+    }
+    else
+    {
+        value = readMemory(memory, segmentBase, address) & lowBitsMask;
     }
-}
 
-string enumRMToString(RM a, int d)
-{
-    switch (a)
+    if ((inst1.op_tag == register_mem_to_from_register) && (inst1.reg_mem_to_from_reg.d == register_is_destination))
     {
-    case RM::ah:
-        return "ah";
-    case RM::al:
-        return "al";
-    case RM::ax:
-        return "ax";
-    case RM::bh:
-        return "bh";
-    case RM::bl:
-        return "bl";
-    case RM::bx:
-        return "bx";
-    case RM::ch:
-        return "ch";
-    case RM::cl:
-        return "cl";
-    case RM::cx:
-        return "cx";
-    case RM::dh:
-        return "dh";
-    case RM::dx:
-        return "dx";
-    case RM::di:
-        return "di";
-    case RM::si:
-        return "si";
-    case RM::sp:
-        return "sp";
-    case RM::bp:
-        return "bp";
-    case RM::bx_plus_si:
-        return "bx + si";
-    case RM::bx_plus_di:
-        return "bx + di";
-    case RM::bp_plus_si:
-        return "bp + si";
-    case RM::bp_plus_di:
-        return "bp + di";
-    case RM::direct_address:
-        return "";
-    case RM::bx_plus_si_plus8:
-    case RM::bx_plus_si_plus16:
-        if (d <= 0)
+        u8 dest = inst1.reg_mem_to_from_reg.dest;
+        i16 destination = cpu.regSlots[dest >> 1];
+        source = value;
+        if (inst1.w == Word)
         {
-            return "bx + si";
+            result = (inst1.mnemonic == add) ? (destination + source) : (destination - source);
+            if (inst1.mnemonic != cmp)
+            {
+                cpu.regSlots[dest >> 1] = result;
+            }
         }
         else
         {
-            return "bx + si +";
+            result = byteResult(inst1.mnemonic, destination, dest, source, true);
+            if (inst1.mnemonic == add)
+            {
+                bytes[dest] += source;
+            }
+            else if (inst1.mnemonic == sub)
+            {
+                bytes[dest] -= source;
+            }
         }
-    case RM::bx_plus_di_plus8:
-    case RM::bx_plus_di_plus16:
-        if (d <= 0)
+    }
+    else
+    {
+        if (inst1.op_tag == immediate_to_register_mem)
         {
-            return "bx + di";
+            source = (inst1.w == Word) ? inst1.imm_to_reg_mem.data : (inst1.imm_to_reg_mem.data & lowBitsMask);
         }
         else
         {
-            return "bx + di +";
+            source = (inst1.w == Word) ? cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1] : bytes[inst1.reg_mem_to_from_reg.source];
         }
-    case RM::bp_plus_si_plus8:
-    case RM::bp_plus_si_plus16:
-        if (d <= 0)
+
+        if (inst1.w == Word)
         {
-            return "bp + si";
+            result = (inst1.mnemonic == add) ? (value + source) : (value - source);
         }
         else
         {
-            return "bp + si +";
+            // The memory byte sits alone, so it goes in as the low half of a zero word
+            result = byteResult(inst1.mnemonic, value, 0, source, inst1.op_tag == register_mem_to_from_register);
         }
-    case RM::bp_plus_di_plus8:
-    case RM::bp_plus_di_plus16:
-        if (d <= 0)
+        if (inst1.mnemonic != cmp)
         {
-            return "bp + di";
+            writeMemory(memory, segmentBase, address, result & lowBitsMask);
+            if (inst1.w == Word)
+            {
+                writeMemory(memory, segmentBase, address + 1, result >> 8);
+            }
         }
-        else
+    }
+    setFlags(inst1.mnemonic, inst1.w, result, source, flag);
+}
+
+template <Mnemonic mnemonic, OperandForm form, bool wide>
+void emulateForm(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag)
+{
+    u8 *bytes = regBytes(cpu);
+    if constexpr ((form == form_mem_imm) || (form == form_mem_reg) || (form == form_reg_mem))
+    {
+        u32 segmentBase = cpu.segmentBase[inst1.segment - 8];
+        int address = getCPUMem(inst1, cpu);
+        i16 value = 0;
+        if constexpr ((mnemonic != mov) || (form == form_reg_mem))
         {
-            return "bp + di +";
+            if constexpr (wide)
+            {
+                value = (readMemory(memory, segmentBase, address + 1) << 8) + (readMemory(memory, segmentBase, address) & lowBitsMask);
+            }
+            else
+            {
+                value = readMemory(memory, segmentBase, address) & lowBitsMask;
+            }
         }
-    case RM::si_plus8:
-    case RM::si_plus16:
-        if (d <= 0)
+
+        if constexpr (form == form_reg_mem)
         {
-            return "si";
+            u8 dest = inst1.reg_mem_to_from_reg.dest;
+            if constexpr (mnemonic == mov)
+            {
+                if constexpr (wide)
+                {
+                    cpu.regSlots[dest >> 1] = value;
+                }
+                else
+                {
+                    bytes[dest] = value;
+                }
+            }
+            else
+            {
+                i16 destination = cpu.regSlots[dest >> 1];
+                i32 result = 0;
+                if constexpr (wide)
+                {
+                    result = (mnemonic == add) ? (destination + value) : (destination - value);
+                    if constexpr (mnemonic != cmp)
+                    {
+                        cpu.regSlots[dest >> 1] = result;
+                    }
+                }
+                else
+                {
+                    result = byteResult(mnemonic, destination, dest, value, true);
+                    if constexpr (mnemonic == add)
+                    {
+                        bytes[dest] += value;
+                    }
+                    else if constexpr (mnemonic == sub)
+                    {
+                        bytes[dest] -= value;
+                    }
+                }
+                setFlags(mnemonic, wide ? Word : Byte, result, value, flag);
+            }
         }
         else
         {
-            return "si +";
-        }
-    case RM::di_plus8:
-    case RM::di_plus16:
-        if (d <= 0)
-        {
-            return "di";
+            i16 source = 0;
+            if constexpr (form == form_mem_imm)
+            {
+                source = wide ? inst1.imm_to_reg_mem.data : (inst1.imm_to_reg_mem.data & lowBitsMask);
+            }
+            else if constexpr (wide)
+            {
+                source = cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1];
+            }
+            else
+            {
+                source = bytes[inst1.reg_mem_to_from_reg.source];
+            }
+
+            i32 result = source;
+            if constexpr (mnemonic != mov)
+            {
+                if constexpr (wide)
+                {
+                    result = (mnemonic == add) ? (value + source) : (value - source);
+                }
+                else
+                {
+                    // Register sources wrap the low byte, immediates don't, as in emulateMemoryArith
+                    result = byteResult(mnemonic, value, 0, source, form == form_mem_reg);
+                }
+                setFlags(mnemonic, wide ? Word : Byte, result, source, flag);
+            }
+            if constexpr (mnemonic != cmp)
+            {
+                writeMemory(memory, segmentBase, address, result & lowBitsMask);
+                if constexpr (wide)
+                {
+                    writeMemory(memory, segmentBase, address + 1, result >> 8);
+                }
+            }
         }
-        else
+    }
+    else
+    {
+        u8 dest = 0;
+        i16 source = 0;
+        if constexpr (form == form_reg_imm)
         {
-            return "di +";
+            dest = inst1.imm_to_reg.dest;
+            source = wide ? inst1.imm_to_reg.data : (inst1.imm_to_reg.data & lowBitsMask);
         }
-    case RM::bp_plus8:
-    case RM::bp_plus16:
-        if (d <= 0)
+        else if constexpr (form == form_rm_imm)
         {
-            return "bp";
+            dest = inst1.imm_to_reg_mem.dest;
+            source = inst1.imm_to_reg_mem.data;
         }
         else
         {
-            return "bp +";
+            dest = inst1.reg_mem_to_from_reg.dest;
+            source = wide ? cpu.regSlots[inst1.reg_mem_to_from_reg.source >> 1] : bytes[inst1.reg_mem_to_from_reg.source];
         }
-    case RM::bx_plus8:
-    case RM::bx_plus16:
-        if (d <= 0)
+
+        if constexpr (mnemonic == mov)
         {
-            return "bx";
+            if constexpr (wide)
+            {
+                cpu.regSlots[dest >> 1] = source;
+            }
+            else
+            {
+                bytes[dest] = source;
+            }
         }
         else
         {
-            return "bx +";
+            i16 destination = cpu.regSlots[dest >> 1];
+            i32 result = 0;
+            if constexpr (wide)
+            {
+                result = (mnemonic == add) ? (destination + source) : (destination - source);
+                if constexpr (mnemonic != cmp)
+                {
+                    cpu.regSlots[dest >> 1] = result;
+                }
+            }
+            else
+            {
+                // Register sources wrap the low byte, immediates don't, as in emulateCommand
+                result = byteResult(mnemonic, destination, dest, source, form == form_reg_reg);
+                if constexpr (mnemonic == add)
+                {
+                    bytes[dest] += source;
+                }
+                else if constexpr (mnemonic == sub)
+                {
+                    bytes[dest] -= source;
+                }
+            }
+            setFlags(mnemonic, wide ? Word : Byte, result, source, flag);
         }
-    default:
-        return "unknown";
-    }
-}
-
-string enumWToString(WFlag b)
-{
-    switch (b)
-    {
-    case WFlag::Byte:
-        return "byte";
-    case WFlag::Not_specified:
-        return "not specified";
-    case WFlag::Word:
-        return "word";
-    default:
-        return "unknown";
-    }
-}
-
-string enumSRToString(SR c)
-{
-    switch (c)
-    {
-    case SR::cs:
-        return "cs";
-    case SR::ds:
-        return "ds";
-    case SR::es:
-        return "es";
-    case SR::ss:
-        return "ss";
-    default:
-        return "unknown";
-    }
-}
-
-string enumMnemonicToString(Mnemonic m)
-{
-    switch (m)
-    {
-    case add:
-        return "add";
-    case cmp:
-        return "cmp";
-    case je:
-        return "je";
-    case jl:
-        return "jl";
-    case jle:
-        return "jle";
-    case jb:
-        return "jb";
-    case jbe:
-        return "jbe";
-    case jp:
-        return "jp";
-    case jo:
-        return "jo";
-    case js:
-        return "js";
-    case jne:
-        return "jne";
-    case jnl:
-        return "jnl";
-    case jg:
-        return "jg";
-    case jnb:
-        return "jnb";
-    case ja:
-        return "ja";
-    case jnp:
-        return "jnp";
-    case jno:
-        return "jno";
-    case jns:
-        return "jns";
-    case loop:
-        return "loop";
-    case loopz:
-        return "loopz";
-    case loopnz:
-        return "loopnz";
-    case jcxz:
-        return "jcxz";
-    case mov:
-        return "mov";
-    case sub:
-        return "sub";
-    default:
-        return "ERROR";
-    }
-}
-
-int getCPUSlotRM(RM ax, Lo_Hi_Byte &lo)
-{
-    switch (ax)
-    {
-    case RM::ax:
-        lo = neither;
-        return 0;
-        break;
-    case RM::ah:
-        lo = high_byte;
-        return 0;
-        break;
-    case RM::al:
-        lo = low_byte;
-        return 0;
-        break;
-    case RM::bx:
-        lo = neither;
-        return 1;
-        break;
-    case RM::bh:
-        lo = high_byte;
-        return 1;
-        break;
-    case RM::bl:
-        lo = low_byte;
-        return 1;
-        break;
-    case RM::cx:
-        lo = neither;
-        return 2;
-        break;
-    case RM::ch:
-        lo = high_byte;
-        return 2;
-        break;
-    case RM::cl:
-        lo = low_byte;
-        return 2;
-        break;
-    case RM::dx:
-        lo = neither;
-        return 3;
-        break;
-    case RM::dh:
-        lo = high_byte;
-        return 3;
-        break;
-    case RM::dl:
-        lo = low_byte;
-        return 3;
-        break;
-    case RM::sp:
-        return 4;
-        break;
-    case RM::bp:
-        return 5;
-        break;
-    case RM::si:
-        return 6;
-        break;
-    case RM::di:
-        return 7;
-        break;
-    default:
-        return -1;
-        break;
     }
 }
 
-int getCPUMem(instruction inst1, RM ax, CPU cpu)
+u8 selectHandler(const instruction &inst1)
 {
-    int operand1 = -1;
-    int operand2 = -1;
-    int operand3 = -1;
-    switch (ax)
-    {
-    case RM::bx_plus_si:
-        operand1 = cpu.regSlots[1];
-        operand2 = cpu.regSlots[6];
-        return operand1 + operand2;
-        break;
-    case RM::bx_plus_di:
-        operand1 = cpu.regSlots[1];
-        operand2 = cpu.regSlots[7];
-        return operand1 + operand2;
+    int slot = 0;
+    switch (inst1.mnemonic)
+    {
+    case mov:
+        slot = 0;
         break;
-    case RM::bp_plus_si:
-        operand1 = cpu.regSlots[5];
-        operand2 = cpu.regSlots[6];
-        return operand1 + operand2;
+    case add:
+        slot = 1;
         break;
-    case RM::bp_plus_di:
-        operand1 = cpu.regSlots[5];
-        operand2 = cpu.regSlots[7];
-        return operand1 + operand2;
+    case sub:
+        slot = 2;
         break;
-    case RM::si:
-        return cpu.regSlots[6];
+    case cmp:
+        slot = 3;
         break;
-    case RM::di:
-        return cpu.regSlots[7];
+    default:
+        return 0;
+    }
+
+    bool registerMode = (modRMTable.entries[inst1.modRM].mode == register_mode);
+    OperandForm form = form_reg_imm;
+    switch (inst1.op_tag)
+    {
+    case immediate_to_register:
+        form = form_reg_imm;
         break;
-    case RM::bx:
-        return cpu.regSlots[1];
+    case immediate_to_register_mem:
+        form = registerMode ? form_rm_imm : form_mem_imm;
         break;
-    case RM::direct_address:
-        switch (inst1.op_tag)
+    case register_mem_to_from_register:
+        if (registerMode)
         {
-        case register_mem_to_from_register:
-            return inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            return inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            return inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            form = form_reg_reg;
         }
-        break;
-    case RM::bx_plus_si_plus8:
-    case RM::bx_plus_si_plus16:
-        operand1 = cpu.regSlots[1];
-        operand2 = cpu.regSlots[6];
-        switch (inst1.op_tag)
+        else
         {
-        case register_mem_to_from_register:
-            operand3 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand3 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand3 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            form = (inst1.reg_mem_to_from_reg.d == register_is_source) ? form_mem_reg : form_reg_mem;
         }
-        return operand1 + operand2 + operand3;
         break;
-    case RM::bx_plus_di_plus8:
-    case RM::bx_plus_di_plus16:
-        operand1 = cpu.regSlots[1];
-        operand2 = cpu.regSlots[7];
-        switch (inst1.op_tag)
+    default:
+        return 0;
+    }
+    return handlerIndex(slot, form, inst1.w == Word);
+}
+
+void executeCommand(const instruction &inst1, CPU &cpu, Memory &memory, Flags &flag)
+{
+    emulateTable.entries[inst1.handler](inst1, cpu, memory, flag);
+}
+
+// A byte add/sub/cmp as the lazy flags see it: the result in place within its word register,
+// wrapped to 8 bits for a register source, left unwrapped for an immediate
+i32 byteResult(Mnemonic mnemonic, i16 destination, int offset, i32 source, bool wrap)
+{
+    i32 result = 0;
+    if ((offset & 1) == 0)
+    {
+        result = (mnemonic == add) ? ((destination & lowBitsMask) + source) : ((destination & lowBitsMask) - source);
+        if (wrap)
         {
-        case register_mem_to_from_register:
-            operand3 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand3 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand3 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            result &= lowBitsMask;
         }
-        return operand1 + operand2 + operand3;
+        result += (destination & highBitsMask);
+    }
+    else
+    {
+        result = (mnemonic == add) ? ((destination & highBitsMask) + (source << 8)) : ((destination & highBitsMask) - (source << 8));
+        result += (destination & lowBitsMask);
+    }
+    return result;
+}
+
+void printOperation(const instruction &inst1, const CPU &cpu)
+{
+    switch (inst1.op_tag)
+    {
+    case immediate_to_register:
+        cout << regList[inst1.imm_to_reg.dest >> 1] << " new value is: " << cpu.regSlots[inst1.imm_to_reg.dest >> 1] << endl;
         break;
-    case RM::bp_plus_si_plus8:
-    case RM::bp_plus_si_plus16:
-        operand1 = cpu.regSlots[5];
-        operand2 = cpu.regSlots[6];
-        switch (inst1.op_tag)
-        {
-        case register_mem_to_from_register:
-            operand3 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand3 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand3 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
-        }
-        return operand1 + operand2 + operand3;
+    case immediate_to_register_mem:
+        cout << regList[inst1.imm_to_reg_mem.dest >> 1] << " new value is: " << cpu.regSlots[inst1.imm_to_reg_mem.dest >> 1] << endl;
         break;
-    case RM::bp_plus_di_plus8:
-    case RM::bp_plus_di_plus16:
-        operand1 = cpu.regSlots[5];
-        operand2 = cpu.regSlots[7];
-        switch (inst1.op_tag)
-        {
-        case register_mem_to_from_register:
-            operand3 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand3 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand3 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
-        }
-        return operand1 + operand2 + operand3;
+    case register_mem_to_from_register:
+        cout << regList[inst1.reg_mem_to_from_reg.dest >> 1] << " new value is: " << cpu.regSlots[inst1.reg_mem_to_from_reg.dest >> 1] << endl;
         break;
-    case RM::si_plus8:
-    case RM::si_plus16:
-        operand1 = cpu.regSlots[6];
-        switch (inst1.op_tag)
+    case register_mem_to_from_seg_register:
+        if (inst1.reg_mem_to_from_seg_reg.d == Direction::segment_register_is_destination)
         {
-        case register_mem_to_from_register:
-            operand2 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand2 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand2 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            cout << regList[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)] << " new value is: " << cpu.regSlots[getCPUSlotSR(inst1.reg_mem_to_from_seg_reg.operandTwo)] << endl;
         }
-        return operand1 + operand2;
-        break;
-    case RM::di_plus8:
-    case RM::di_plus16:
-        operand1 = cpu.regSlots[7];
-        switch (inst1.op_tag)
+        else
         {
-        case register_mem_to_from_register:
-            operand2 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand2 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand2 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            cout << regList[inst1.reg_mem_to_from_seg_reg.operandOne >> 1] << " new value is: " << cpu.regSlots[inst1.reg_mem_to_from_seg_reg.operandOne >> 1] << endl;
         }
-        return operand1 + operand2;
         break;
-    case RM::bp_plus8:
-    case RM::bp_plus16:
-        operand1 = cpu.regSlots[5];
-        switch (inst1.op_tag)
+    case memory_to_acc_or_vv:
+        if (inst1.mem_to_acc.d == Direction::accumulator_is_destination)
         {
-        case register_mem_to_from_register:
-            operand2 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand2 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand2 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            cout << regList[getRegOffset(inst1.mem_to_acc.operandOne) >> 1] << " new value is: " << cpu.regSlots[getRegOffset(inst1.mem_to_acc.operandOne) >> 1] << endl;
         }
-        return operand1 + operand2;
-        break;
-    case RM::bx_plus8:
-    case RM::bx_plus16:
-        operand1 = cpu.regSlots[1];
-        switch (inst1.op_tag)
+        else
         {
-        case register_mem_to_from_register:
-            operand2 = inst1.reg_mem_to_from_reg.disp;
-            break;
-        case immediate_to_register_mem:
-            operand2 = inst1.imm_to_reg_mem.disp;
-            break;
-        case register_mem_to_from_seg_register:
-            operand2 = inst1.reg_mem_to_from_seg_reg.disp;
-            break;
+            cout << "Not yet coded - ERROR" << endl;
         }
-        return operand1 + operand2;
         break;
+    default:
+        throw runtime_error("Invalid Optag");
+    }
+}
+
+string_view enumRMToString(RM a, int d)
+{
+    // Displaced effective addresses read "bx + si +" when a positive displacement follows
+    if (d > 0)
+    {
+        return rmPlusNames[(int)a];
     }
-    cout << "Invalid register/memory location." << endl;
-    exit(1);
+    return rmNames[(int)a];
+}
+
+string_view enumWToString(WFlag b)
+{
+    return wNames[b];
+}
+
+string_view enumSRToString(SR c)
+{
+    return srNames[(int)c];
+}
+
+string_view enumMnemonicToString(Mnemonic m)
+{
+    return mnemonicNames[m];
+}
+
+u8 getRegOffset(RM rm)
+{
+    if ((int)rm > (int)RM::di)
+    {
+        return noRegister;
+    }
+    return regOffsets[(int)rm];
+}
+
+int getCPUMem(const instruction &inst1, const CPU &cpu)
+{
+    // Offset within the segment: base and index registers from the ModRM table plus the displacement,
+    // absent ones read zeroSlot so every mode takes the same path
+    const ModRMInfo &ea = modRMTable.entries[inst1.modRM];
+    return inst1.memory.disp + cpu.regSlots[ea.base] + cpu.regSlots[ea.index];
 }
 
 int getCPUSlotSR(SR es)
@@ -2580,159 +6119,90 @@ int getCPUSlotSR(SR es)
     }
 }
 
-void setFlags(instruction inst1, i32 result, i32 source, Flags &flag)
+void setFlags(Mnemonic mnemonic, WFlag w, i32 result, i32 source, Flags &flag)
 {
-    // Parity Flag
-    int parity = (result & 1);
-    for (int i = 1; i < 9; i++)
-    {
-        parity += (((result & lowBitsMask) >> i) & singBitConv);
-    }
+    // Only record the operation, FLAGS is worked out when something reads it
+    flag.pending = true;
+    flag.lastMnemonic = mnemonic;
+    flag.lastW = w;
+    flag.lastResult = result;
+    flag.lastSource = source;
+}
 
-    if (parity % 2 == 0)
-    {
-        flag.flags[13] = true;
-    }
-    else
+u16 readFlags(Flags &flag)
+{
+    if (flag.pending)
     {
-        flag.flags[13] = false;
+        flag.value = computeFlags(flag);
+        flag.pending = false;
     }
+    return flag.value;
+}
 
-    // Zero Flag
-    if (result == 0)
-    {
-        flag.flags[9] = true;
-    }
-    else
-    {
-        flag.flags[9] = false;
-    }
+bool testFlags(Flags &flag, u16 mask)
+{
+    return (readFlags(flag) & mask) != 0;
+}
 
-    // Sign Flag
-    if (inst1.w == Word)
+u16 computeFlags(const Flags &flag)
+{
+    Mnemonic mnemonic = flag.lastMnemonic;
+    i32 result = flag.lastResult;
+    i32 source = flag.lastSource;
+    bool isArith = (mnemonic == add) || (mnemonic == sub) || (mnemonic == cmp);
+
+    // Parity, Zero and Sign Flags
+    u16 value = flag.value & ~(flagCF | flagPF | flagZF | flagSF | flagOF);
+    value |= parityTable.entries[result & lowBitsMask];
+    value |= (result == 0) ? flagZF : 0;
+    value |= (((result >> ((flag.lastW == Word) ? 15 : 7)) & 1) != 0) ? flagSF : 0;
+
+    // Carry Flag
+    if (mnemonic == add)
     {
-        if (((result >> 15) & 1) == 1)
-        {
-            flag.flags[8] = true;
-        }
-        else
-        {
-            flag.flags[8] = false;
-        }
+        value |= (result > 255) ? flagCF : 0;
     }
-    else
+    else if ((mnemonic == sub) || (mnemonic == cmp))
     {
-        if (((result >> 7) & 1) == 1)
-        {
-            flag.flags[8] = true;
-        }
-        else
-        {
-            flag.flags[8] = false;
-        }
+        value |= (result < 0) ? flagCF : 0;
     }
 
-    // Carry Flag
-    switch (inst1.mnemonic)
+    // Overflow Flag
+    if (isArith && (flag.lastW == Word))
     {
-    case add:
-        if (result > 255)
-        {
-            flag.flags[15] = true;
-        }
-        else
-        {
-            flag.flags[15] = false;
-        }
-        break;
-    case sub:
-    case cmp:
-        if (result < 0)
-        {
-            flag.flags[15] = true;
-        }
-        else
-        {
-            flag.flags[15] = false;
-        }
-        break;
-    default:
-        flag.flags[15] = false;
+        value |= ((result > 65535) || (result < -32768)) ? flagOF : 0;
     }
-
-    // Overflow Flag
-    switch (inst1.mnemonic)
+    else if (isArith)
     {
-    case add:
-    case sub:
-    case cmp:
-        if (inst1.w == Word)
-        {
-            if ((result > 65535) || (result < -32768))
-            {
-                flag.flags[4] = true;
-            }
-            else
-            {
-                flag.flags[4] = false;
-            }
-        }
-        else
-        {
-            if ((result > 255) || (result < -127))
-            {
-                flag.flags[4] = true;
-            }
-            else
-            {
-                flag.flags[4] = false;
-            }
-        }
-        break;
-    default:
-        flag.flags[4] = false;
-        break;
+        value |= ((result > 255) || (result < -127)) ? flagOF : 0;
     }
 
     // Auxilliary Carry Flag
     i8 lowNibbleSource = (source & fourBitConv);
     i8 lowNibbleDestination = 0;
-    switch (inst1.mnemonic)
+    if (mnemonic == add)
     {
-    case add:
         lowNibbleDestination = ((result - source) & fourBitConv);
-        if ((lowNibbleDestination + lowNibbleSource) > 15)
-        {
-            flag.flags[11] = true;
-        }
-        else
-        {
-            flag.flags[11] = false;
-        }
-        break;
-    case sub:
-        lowNibbleDestination = ((result + source) & fourBitConv);
-    case cmp:
+        value = (value & ~flagAF) | (((lowNibbleDestination + lowNibbleSource) > 15) ? flagAF : 0);
+    }
+    else if ((mnemonic == sub) || (mnemonic == cmp))
+    {
         lowNibbleDestination = ((result + source) & fourBitConv);
-        if (lowNibbleDestination >= lowNibbleSource)
-        {
-            flag.flags[11] = false;
-        }
-        else
-        {
-            flag.flags[11] = true;
-        }
+        value = (value & ~flagAF) | ((lowNibbleDestination < lowNibbleSource) ? flagAF : 0);
     }
+    return value;
 }
 
 void printFlags(Flags &flag)
 {
-    for (int i = 0; i < 16; i++)
+    flushOutput();
+    u16 value = readFlags(flag);
+    for (int i = 15; i >= 0; i--)
     {
-        if (flag.flags[i] != 0)
+        if ((value >> i) & 1)
         {
             cout << " " << flagsList[i] << " ";
         }
     }
     cout << endl;
-}
\ No newline at end of file
+}
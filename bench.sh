@@ -0,0 +1,4 @@
+#!/bin/bash
+# Builds with optimizations and times the decoder, simulator and printer over every bundled listing
+g++ -O2 Decompiler.cpp -o decompiler
+./decompiler --bench-suite --results="${1:-bench_results.json}" listing_*
@@ -4,4 +4,4 @@ if [ $# -lt 1 ]; then
     exit 1
 fi
 g++ Decompiler.cpp -o decompiler
-./decompiler $1
+./decompiler "$@"